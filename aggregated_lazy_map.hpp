@@ -0,0 +1,217 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+// lazy_map that keeps an aggregate (sum, count, min, max, ...) of its values
+// up to date across copies and edits.
+
+#ifndef QUICK_AGGREGATED_LAZY_MAP_HPP_
+#define QUICK_AGGREGATED_LAZY_MAP_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+#include "lazy_map.hpp"
+
+namespace quick {
+namespace lazy_map_impl {
+
+// A Monoid aggregates the values of type V of a map:
+//   struct my_monoid {
+//     using value_type = ...;
+//     value_type identity() const;
+//     value_type lift(const V& v) const;  // Aggregate of the single value @v.
+//     value_type combine(const value_type& a, const value_type& b) const;
+//     // Optional, for invertible monoids: the x with combine(x, b) == a.
+//     value_type subtract(const value_type& a, const value_type& b) const;
+//   };
+
+template<typename T>
+struct sum_monoid {
+  using value_type = T;
+  T identity() const { return T(); }
+  T lift(const T& v) const { return v; }
+  T combine(const T& a, const T& b) const { return a + b; }
+  T subtract(const T& a, const T& b) const { return a - b; }
+};
+
+// Number of entries, whatever the value type.
+struct count_monoid {
+  using value_type = size_t;
+  size_t identity() const { return 0; }
+  template<typename V>
+  size_t lift(const V&) const { return 1; }
+  size_t combine(size_t a, size_t b) const { return a + b; }
+  size_t subtract(size_t a, size_t b) const { return a - b; }
+};
+
+// Not invertible: an overwritten or erased value makes aggregate() recompute.
+template<typename T>
+struct min_monoid {
+  using value_type = T;
+  T identity() const { return std::numeric_limits<T>::max(); }
+  T lift(const T& v) const { return v; }
+  T combine(const T& a, const T& b) const { return std::min(a, b); }
+};
+
+template<typename T>
+struct max_monoid {
+  using value_type = T;
+  T identity() const { return std::numeric_limits<T>::lowest(); }
+  T lift(const T& v) const { return v; }
+  T combine(const T& a, const T& b) const { return std::max(a, b); }
+};
+
+template<typename M, typename = void>
+struct is_invertible_monoid : std::false_type { };
+
+template<typename M>
+struct is_invertible_monoid<M, std::void_t<decltype(
+    std::declval<const M&>().subtract(
+        std::declval<const typename M::value_type&>(),
+        std::declval<const typename M::value_type&>()))>> : std::true_type { };
+
+// - A lazy_map<K, V> along with the aggregate of its values under @Monoid.
+// - The aggregate is cached in the map and copied along with it, so
+//   aggregate() on a copy is O(1). Every write updates it from the delta:
+//   an inserted value is combined in, and an overwritten or erased value is
+//   subtracted out if the monoid is invertible.
+// - Non-invertible monoids (min, max, ...) can't take a value out. An
+//   overwrite or erase then marks the aggregate stale, and the next
+//   aggregate() recomputes it in O(size), once per burst of such writes.
+// - Values are only readable, as in lazy_map. Writes go through the methods
+//   below.
+template<typename K, typename V, typename Monoid>
+class aggregated_lazy_map {
+ public:
+  using map_type = lazy_map<K, V>;
+  using key_type = K;
+  using mapped_type = V;
+  using aggregate_type = typename Monoid::value_type;
+  using const_iterator = typename map_type::const_iterator;
+  using iterator = const_iterator;
+  static constexpr bool invertible = is_invertible_monoid<Monoid>::value;
+
+  explicit aggregated_lazy_map(Monoid monoid = Monoid())
+    : monoid_(std::move(monoid)), aggregate_(monoid_.identity()) { }
+  aggregated_lazy_map(std::initializer_list<typename map_type::value_type> l,
+                      Monoid monoid = Monoid())
+    : map_(l), monoid_(std::move(monoid)), aggregate_(monoid_.identity()),
+      stale_(true) { }
+
+  // Aggregate of all the values, monoid.identity() if the map is empty.
+  // Recomputing a stale aggregate updates the cache, hence concurrent calls
+  // on the same map are not safe after a write, as for any other write.
+  const aggregate_type& aggregate() const {
+    if (stale_) {
+      aggregate_ = monoid_.identity();
+      for (const auto& kv : map_) {
+        aggregate_ = monoid_.combine(aggregate_, monoid_.lift(kv.second));
+      }
+      stale_ = false;
+    }
+    return aggregate_;
+  }
+
+  const map_type& map() const { return map_; }
+
+  bool contains(const K& k) const { return map_.contains(k); }
+  const V& at(const K& k) const { return map_.at(k); }
+  const V& operator[](const K& k) const { return map_.at(k); }
+  size_t size() const { return map_.size(); }
+  bool empty() const { return map_.empty(); }
+  size_t get_depth() const { return map_.get_depth(); }
+  const_iterator begin() const { return map_.begin(); }
+  const_iterator end() const { return map_.end(); }
+  const_iterator find(const K& k) const { return map_.find(k); }
+
+  // The value is unchanged, and so is the aggregate.
+  bool detach() { return map_.detach(); }
+
+  template<typename M>
+  void insert_or_assign(const K& k, M&& v) {
+    auto it = map_.find(k);
+    cache next = (it == map_.end()) ? current() : without(it->second);
+    add(&next, v);
+    map_.insert_or_assign(k, std::forward<M>(v));
+    commit(std::move(next));
+  }
+
+  template<typename M>
+  bool insert(const K& k, M&& v) {
+    if (map_.contains(k)) return false;
+    cache next = current();
+    add(&next, v);
+    map_.insert_or_assign(k, std::forward<M>(v));
+    commit(std::move(next));
+    return true;
+  }
+
+  bool erase(const K& k) {
+    auto it = map_.find(k);
+    if (it == map_.end()) return false;
+    cache next = without(it->second);
+    map_.erase(k);
+    commit(std::move(next));
+    return true;
+  }
+
+  void clear() {
+    map_.clear();
+    aggregate_ = monoid_.identity();
+    stale_ = false;
+  }
+
+ private:
+  struct cache {
+    aggregate_type aggregate;
+    bool stale;
+  };
+
+  // The next cache is computed before a write to the map, which may move
+  // from the written value, and committed after it: a write that throws
+  // leaves the cache matching the map.
+  cache current() const { return cache{aggregate_, stale_}; }
+
+  // The cache with the value @v taken out.
+  cache without(const V& v) const {
+    cache next = current();
+    if constexpr (invertible) {
+      if (not next.stale) {
+        next.aggregate = monoid_.subtract(next.aggregate, monoid_.lift(v));
+      }
+    } else {
+      next.stale = true;
+    }
+    return next;
+  }
+
+  void add(cache* next, const V& v) const {
+    if (not next->stale) {
+      next->aggregate = monoid_.combine(next->aggregate, monoid_.lift(v));
+    }
+  }
+
+  void commit(cache&& next) {
+    aggregate_ = std::move(next.aggregate);
+    stale_ = next.stale;
+  }
+
+  map_type map_;
+  Monoid monoid_;
+  mutable aggregate_type aggregate_;
+  mutable bool stale_ = false;
+};
+
+}  // namespace lazy_map_impl
+
+using lazy_map_impl::aggregated_lazy_map;
+using lazy_map_impl::sum_monoid;
+using lazy_map_impl::count_monoid;
+using lazy_map_impl::min_monoid;
+using lazy_map_impl::max_monoid;
+
+}  // namespace quick
+
+#endif  // QUICK_AGGREGATED_LAZY_MAP_HPP_
@@ -0,0 +1,117 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+#include "aggregated_lazy_map.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using std::vector;
+using quick::aggregated_lazy_map;
+
+TEST(AggregatedLazyMapTest, InvertibleMonoid) {
+  aggregated_lazy_map<std::string, int, quick::sum_monoid<int>> m;
+  EXPECT_EQ(0, m.aggregate());
+  m.insert_or_assign("a", 10);
+  m.insert_or_assign("b", 20);
+  EXPECT_TRUE(m.insert("c", 30));
+  EXPECT_FALSE(m.insert("c", 300));
+  EXPECT_EQ(60, m.aggregate());
+  auto m2 = m;
+  m2.insert_or_assign("a", 1);
+  m2.erase("b");
+  EXPECT_FALSE(m2.erase("x"));
+  EXPECT_EQ(31, m2.aggregate());
+  EXPECT_EQ(60, m.aggregate());
+  m2.detach();
+  EXPECT_EQ(31, m2.aggregate());
+  // Copies of copies, each edited a bit.
+  vector<decltype(m)> history = {m};
+  for (int i = 0; i < 100; i++) {
+    auto next = history.back();
+    next.insert_or_assign(std::to_string(i), i);
+    history.push_back(next);
+  }
+  EXPECT_EQ(60 + 4950, history.back().aggregate());
+  EXPECT_EQ(60 + 45, history[10].aggregate());
+  m.clear();
+  EXPECT_EQ(0, m.aggregate());
+  EXPECT_EQ(60, history[0].aggregate());
+}
+
+TEST(AggregatedLazyMapTest, NonInvertibleMonoid) {
+  aggregated_lazy_map<int, int, quick::max_monoid<int>> m = {{1, 5}, {2, 9}};
+  EXPECT_EQ(9, m.aggregate());
+  m.insert_or_assign(3, 7);
+  EXPECT_EQ(9, m.aggregate());
+  auto m2 = m;
+  m2.erase(2);
+  EXPECT_EQ(7, m2.aggregate());
+  m2.insert_or_assign(3, 1);
+  m2.insert_or_assign(4, 2);
+  EXPECT_EQ(5, m2.aggregate());
+  EXPECT_EQ(9, m.aggregate());
+  aggregated_lazy_map<int, int, quick::min_monoid<int>> m3;
+  EXPECT_EQ(std::numeric_limits<int>::max(), m3.aggregate());
+  m3.insert_or_assign(1, 4);
+  m3.insert_or_assign(2, 3);
+  EXPECT_EQ(3, m3.aggregate());
+  static_assert(not decltype(m3)::invertible);
+  static_assert(decltype(m2)::invertible == false);
+}
+
+TEST(AggregatedLazyMapTest, CountMonoid) {
+  aggregated_lazy_map<int, std::string, quick::count_monoid> m;
+  m.insert_or_assign(1, "a");
+  m.insert_or_assign(2, "b");
+  m.insert_or_assign(2, "c");
+  EXPECT_EQ(2, m.aggregate());
+  auto m2 = m;
+  m2.erase(1);
+  EXPECT_EQ(1, m2.aggregate());
+  EXPECT_EQ(m.size(), m.aggregate());
+  EXPECT_EQ("c", m.at(2));
+}
+
+struct ThrowingCopy {
+  explicit ThrowingCopy(int v) : v(v) { }
+  ThrowingCopy(const ThrowingCopy& o) : v(o.v) { maybe_throw(); }
+  ThrowingCopy& operator=(const ThrowingCopy& o) {
+    maybe_throw();
+    v = o.v;
+    return *this;
+  }
+  static void maybe_throw() {
+    if (fail) throw std::runtime_error("copy");
+  }
+  static inline bool fail = false;
+  int v;
+};
+
+struct ThrowingCopySum {
+  using value_type = int;
+  int identity() const { return 0; }
+  int lift(const ThrowingCopy& x) const { return x.v; }
+  int combine(int a, int b) const { return a + b; }
+  int subtract(int a, int b) const { return a - b; }
+};
+
+TEST(AggregatedLazyMapTest, FailedWriteKeepsAggregate) {
+  aggregated_lazy_map<int, ThrowingCopy, ThrowingCopySum> m;
+  m.insert_or_assign(1, ThrowingCopy(10));
+  ThrowingCopy x(5);
+  ThrowingCopy::fail = true;
+  EXPECT_THROW(m.insert(2, x), std::runtime_error);
+  EXPECT_THROW(m.insert_or_assign(1, x), std::runtime_error);
+  ThrowingCopy::fail = false;
+  EXPECT_EQ(1, m.size());
+  EXPECT_EQ(10, m.at(1).v);
+  EXPECT_EQ(10, m.aggregate());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
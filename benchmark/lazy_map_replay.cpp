@@ -0,0 +1,398 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+// Replays a trace recorded with QUICK_LAZY_MAP_TRACE (see lazy_map_trace.hpp)
+// against lazy_map and std::unordered_map, and reports the throughput, the
+// latency of each operation and the peak memory of each.
+//
+// Build (Linux) from the repository root:
+//   g++ -std=c++17 -O3 -I. benchmark/lazy_map_replay.cpp -o /tmp/replay
+// Run:
+//   /tmp/replay <trace_file>
+//   /tmp/replay --synthetic <num_ops>  # Without a trace, a generated one.
+//   /tmp/replay --alloc ...  # Allocations per operation instead of latency.
+//
+// Keys and values are replayed as uint64_t. A copy of a std::unordered_map
+// is a deep copy, and detach(), compact() and flatten_*() are no-ops for it.
+// Each container is replayed in a child process so that their peak RSS are
+// independent.
+//
+// The --alloc mode counts the calls to the global operator new, replaced
+// below, made by each operation: fragments, hash nodes, bucket arrays and
+// so on. Allocations are the usual bottleneck of multi-threaded use.
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lazy_map.hpp"
+#include "lazy_map_trace.hpp"
+
+namespace {
+
+// Allocations made while counting_allocs, in --alloc mode. The replay is
+// single threaded.
+bool counting_allocs = false;
+uint64_t num_allocs = 0;
+uint64_t num_alloc_bytes = 0;
+uint64_t num_frees = 0;
+
+// The replaced operator new and operator delete go through this matching
+// pair. Not inlined, otherwise -Wmismatched-new-delete sees free() called on
+// memory from operator new.
+[[gnu::noinline]] void* counted_malloc(size_t n) {
+  if (counting_allocs) {
+    num_allocs++;
+    num_alloc_bytes += n;
+  }
+  return std::malloc(n == 0 ? 1 : n);
+}
+
+[[gnu::noinline]] void counted_free(void* p) {
+  if (counting_allocs and p != nullptr) num_frees++;
+  std::free(p);
+}
+
+}  // namespace
+
+void* operator new(size_t n) {
+  if (void* p = counted_malloc(n)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  counted_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  counted_free(p);
+}
+
+namespace {
+
+using quick::lazy_map_trace::op;
+using quick::lazy_map_trace::trace_record;
+
+constexpr int kNumOps = static_cast<int>(op::flatten_until) + 1;
+constexpr int kNumBuckets = 40;
+
+const char* op_name(op o) {
+  switch (o) {
+    case op::copy: return "copy";
+    case op::move: return "move";
+    case op::insert_or_assign: return "insert_or_assign";
+    case op::insert: return "insert";
+    case op::erase: return "erase";
+    case op::find: return "find";
+    case op::detach: return "detach";
+    case op::clear: return "clear";
+    case op::destroy: return "destroy";
+    case op::rebase: return "rebase";
+    case op::compact: return "compact";
+    case op::flatten_top: return "flatten_top";
+    case op::flatten_until: return "flatten_until";
+  }
+  return "unknown";
+}
+
+// Latencies of one operation, in buckets of powers of 2 nanoseconds.
+struct latency_histogram {
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t max_ns = 0;
+  uint64_t buckets[kNumBuckets] = {};
+
+  void add(uint64_t ns) {
+    count++;
+    total_ns += ns;
+    max_ns = std::max(max_ns, ns);
+    int b = 0;
+    while ((ns >> b) > 1 and b + 1 < kNumBuckets) b++;
+    buckets[b]++;
+  }
+
+  // Upper bound of the @q quantile.
+  uint64_t quantile(double q) const {
+    uint64_t seen = 0;
+    for (int b = 0; b < kNumBuckets; b++) {
+      seen += buckets[b];
+      if (seen >= q * count) return std::min(uint64_t(2) << b, max_ns);
+    }
+    return max_ns;
+  }
+};
+
+struct lazy_map_adapter {
+  using map_type = quick::lazy_map<uint64_t, uint64_t>;
+  static constexpr const char* name = "lazy_map";
+  static bool find(const map_type& m, uint64_t k) { return m.contains(k); }
+  static void detach(map_type& m) { m.detach(); }
+  static void rebase(map_type& m, const map_type& old_base,
+                     const map_type& new_base) {
+    m.rebase(old_base, new_base);
+  }
+  static void compact(map_type& m, uint64_t ratio) { m.compact(ratio); }
+  static void flatten_top(map_type& m, uint64_t k) { m.flatten_top(k); }
+  static void flatten_until(map_type& m, uint64_t size_threshold) {
+    m.flatten_until(size_threshold);
+  }
+};
+
+struct unordered_map_adapter {
+  using map_type = std::unordered_map<uint64_t, uint64_t>;
+  static constexpr const char* name = "std::unordered_map";
+  static bool find(const map_type& m, uint64_t k) { return m.count(k) > 0; }
+  static void detach(map_type&) { }
+  // The edits of @m are its differences from @old_base.
+  static void rebase(map_type& m, const map_type& old_base,
+                     const map_type& new_base) {
+    map_type output = new_base;
+    for (const auto& kv : old_base) {
+      if (m.count(kv.first) == 0) output.erase(kv.first);
+    }
+    for (const auto& kv : m) {
+      auto it = old_base.find(kv.first);
+      if (it == old_base.end() or it->second != kv.second) {
+        output.insert_or_assign(kv.first, kv.second);
+      }
+    }
+    m = std::move(output);
+  }
+  static void compact(map_type&, uint64_t) { }
+  static void flatten_top(map_type&, uint64_t) { }
+  static void flatten_until(map_type&, uint64_t) { }
+};
+
+long peak_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+long current_rss_kb() {
+  long pages = 0, resident = 0;
+  std::FILE* f = std::fopen("/proc/self/statm", "r");
+  if (f == nullptr) return 0;
+  if (std::fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  std::fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Applies @r to @maps, indexed by map id.
+template<typename Adapter>
+void apply(const trace_record& r, std::vector<typename Adapter::map_type>* maps,
+           size_t* found) {
+  auto& m = (*maps)[r.map];
+  switch (r.type) {
+    case op::copy: m = (*maps)[r.arg]; break;
+    case op::move: m = std::move((*maps)[r.arg]); break;
+    case op::insert_or_assign: m.insert_or_assign(r.arg, r.value); break;
+    case op::insert: m.insert({r.arg, r.value}); break;
+    case op::erase: m.erase(r.arg); break;
+    case op::find: *found += Adapter::find(m, r.arg); break;
+    case op::detach: Adapter::detach(m); break;
+    case op::clear: m.clear(); break;
+    case op::destroy: m = typename Adapter::map_type(); break;
+    case op::rebase:
+      Adapter::rebase(m, (*maps)[r.arg & 0xffffffff], (*maps)[r.arg >> 32]);
+      break;
+    case op::compact: Adapter::compact(m, r.arg); break;
+    case op::flatten_top: Adapter::flatten_top(m, r.arg); break;
+    case op::flatten_until: Adapter::flatten_until(m, r.arg); break;
+  }
+}
+
+// Maps are numbered from 0 in a trace.
+size_t num_maps(const std::vector<trace_record>& trace) {
+  size_t output = 0;
+  for (const auto& r : trace) {
+    output = std::max<size_t>(output, r.map + 1);
+    if (r.type == op::copy or r.type == op::move) {
+      output = std::max<size_t>(output, r.arg + 1);
+    } else if (r.type == op::rebase) {
+      output = std::max<size_t>(output, (r.arg & 0xffffffff) + 1);
+      output = std::max<size_t>(output, (r.arg >> 32) + 1);
+    }
+  }
+  return output;
+}
+
+template<typename Adapter>
+void replay(const std::vector<trace_record>& trace) {
+  long rss_before = current_rss_kb();
+  std::vector<typename Adapter::map_type> maps(num_maps(trace));
+  latency_histogram histograms[kNumOps];
+  size_t found = 0;
+  for (const auto& r : trace) {
+    auto start = std::chrono::steady_clock::now();
+    apply<Adapter>(r, &maps, &found);
+    auto end = std::chrono::steady_clock::now();
+    histograms[static_cast<int>(r.type)].add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            end - start).count());
+  }
+  uint64_t total_ns = 0;
+  for (const auto& h : histograms) {
+    total_ns += h.total_ns;
+  }
+  std::printf("%s: %zu ops in %.3f ms, %.2f Mops/s, peak RSS +%ld KiB, "
+              "%zu found\n",
+              Adapter::name, trace.size(), total_ns / 1e6,
+              trace.size() * 1e3 / std::max<uint64_t>(total_ns, 1),
+              peak_rss_kb() - rss_before, found);
+  std::printf("  %-18s %10s %10s %10s %10s %10s\n", "op", "count",
+              "mean_ns", "p50_ns", "p99_ns", "max_ns");
+  for (int i = 1; i < kNumOps; i++) {
+    const auto& h = histograms[i];
+    if (h.count == 0) continue;
+    std::printf("  %-18s %10lu %10lu %10lu %10lu %10lu\n",
+                op_name(static_cast<op>(i)), (unsigned long)h.count,
+                (unsigned long)(h.total_ns / h.count),
+                (unsigned long)h.quantile(0.5),
+                (unsigned long)h.quantile(0.99), (unsigned long)h.max_ns);
+  }
+  std::fflush(stdout);
+}
+
+struct alloc_stats {
+  uint64_t count = 0;
+  uint64_t allocs = 0;
+  uint64_t bytes = 0;
+  uint64_t frees = 0;
+};
+
+// Allocations and frees per operation, in --alloc mode.
+template<typename Adapter>
+void replay_allocs(const std::vector<trace_record>& trace) {
+  std::vector<typename Adapter::map_type> maps(num_maps(trace));
+  alloc_stats stats[kNumOps];
+  size_t found = 0;
+  for (const auto& r : trace) {
+    uint64_t allocs = num_allocs, bytes = num_alloc_bytes, frees = num_frees;
+    counting_allocs = true;
+    apply<Adapter>(r, &maps, &found);
+    counting_allocs = false;
+    auto& s = stats[static_cast<int>(r.type)];
+    s.count++;
+    s.allocs += num_allocs - allocs;
+    s.bytes += num_alloc_bytes - bytes;
+    s.frees += num_frees - frees;
+  }
+  alloc_stats total;
+  for (const auto& s : stats) {
+    total.count += s.count;
+    total.allocs += s.allocs;
+    total.bytes += s.bytes;
+    total.frees += s.frees;
+  }
+  std::printf("%s: %zu ops, %.3f allocs/op, %.1f bytes/op, %.3f frees/op\n",
+              Adapter::name, trace.size(),
+              total.allocs / std::max(1.0, double(total.count)),
+              total.bytes / std::max(1.0, double(total.count)),
+              total.frees / std::max(1.0, double(total.count)));
+  std::printf("  %-18s %10s %12s %12s %12s\n", "op", "count", "allocs/op",
+              "bytes/op", "frees/op");
+  for (int i = 1; i < kNumOps; i++) {
+    const auto& s = stats[i];
+    if (s.count == 0) continue;
+    std::printf("  %-18s %10lu %12.3f %12.1f %12.3f\n",
+                op_name(static_cast<op>(i)), (unsigned long)s.count,
+                double(s.allocs) / s.count, double(s.bytes) / s.count,
+                double(s.frees) / s.count);
+  }
+  std::fflush(stdout);
+}
+
+// Runs @Adapter's replay in a child process, for its own peak RSS.
+template<typename Adapter>
+void replay_in_child(const std::vector<trace_record>& trace, bool allocs) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (allocs) {
+      replay_allocs<Adapter>(trace);
+    } else {
+      replay<Adapter>(trace);
+    }
+    std::_Exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+std::vector<trace_record> read_trace(const char* path) {
+  std::vector<trace_record> trace;
+  std::FILE* in = std::fopen(path, "rb");
+  if (in == nullptr) {
+    std::perror(path);
+    std::exit(1);
+  }
+  while (auto r = quick::lazy_map_trace::read_record(in)) {
+    trace.push_back(*r);
+  }
+  std::fclose(in);
+  return trace;
+}
+
+// Versions of one large map: each is a copy of the previous one with a few
+// writes, read a few times and dropped after a while.
+std::vector<trace_record> synthetic_trace(size_t num_ops) {
+  std::vector<trace_record> trace;
+  std::mt19937_64 rng(0);
+  const uint64_t num_keys = 100000;
+  const uint32_t num_live = 16;
+  for (uint64_t k = 0; k < num_keys; k++) {
+    trace.push_back({op::insert_or_assign, 0, k, k});
+  }
+  uint32_t head = 0;
+  while (trace.size() < num_ops) {
+    uint32_t next = head + 1;
+    trace.push_back({op::copy, next, head, 0});
+    for (int i = 0; i < 20; i++) {
+      uint64_t k = rng() % num_keys;
+      if (rng() % 4 == 0) {
+        trace.push_back({op::erase, next, k, 0});
+      } else {
+        trace.push_back({op::insert_or_assign, next, k, rng()});
+      }
+    }
+    for (int i = 0; i < 100; i++) {
+      trace.push_back({op::find, next, rng() % num_keys, 0});
+    }
+    if (next % 64 == 0) trace.push_back({op::detach, next, 0, 0});
+    if (next >= num_live) trace.push_back({op::destroy, next - num_live, 0, 0});
+    head = next;
+  }
+  return trace;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool allocs = (argc > 1 and std::strcmp(argv[1], "--alloc") == 0);
+  int first_arg = allocs ? 2 : 1;
+  std::vector<trace_record> trace;
+  if (argc == first_arg + 2
+        and std::strcmp(argv[first_arg], "--synthetic") == 0) {
+    trace = synthetic_trace(std::strtoull(argv[first_arg + 1], nullptr, 10));
+  } else if (argc == first_arg + 1) {
+    trace = read_trace(argv[first_arg]);
+  } else {
+    std::fprintf(stderr, "Usage: %s [--alloc] <trace_file> | "
+                 "[--alloc] --synthetic <num_ops>\n", argv[0]);
+    return 1;
+  }
+  replay_in_child<lazy_map_adapter>(trace, allocs);
+  replay_in_child<unordered_map_adapter>(trace, allocs);
+  return 0;
+}
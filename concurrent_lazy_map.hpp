@@ -0,0 +1,201 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+// lazy_map shared by concurrent readers and writers, without an external
+// lock around it.
+
+#ifndef QUICK_CONCURRENT_LAZY_MAP_HPP_
+#define QUICK_CONCURRENT_LAZY_MAP_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "lazy_map.hpp"
+
+namespace quick {
+namespace lazy_map_impl {
+
+// - Map on which many threads may insert, erase and look up at once. The
+//   keys are spread over a fixed number of stripes by hash, each stripe
+//   being a lazy_map guarded by its own reader-writer lock. Hence writers
+//   of different stripes don't contend, and readers never wait on each
+//   other.
+// - find() returns a copy of the value, since a reference would outlive the
+//   lock. Use cheap to copy values (lazy_map, cow_wrapper, ...) for large
+//   ones.
+// - snapshot() is an immutable point-in-time copy of the whole map, in
+//   O(stripes): each stripe is a lazy_map, copied in O(1) while all the
+//   stripes are read-locked. The next write to a stripe pushes a fragment
+//   on top of the snapshotted one, as with any lazy_map copy.
+// - Construction, assignment and destruction must not race with other calls
+//   on the same object, same as for a std::mutex.
+template<typename K, typename V>
+class concurrent_lazy_map {
+ public:
+  using map_type = lazy_map<K, V>;
+  using key_type = K;
+  using mapped_type = V;
+
+  // @num_stripes is rounded up to a power of 2. More stripes means less
+  // contention between writers, and costlier snapshots.
+  explicit concurrent_lazy_map(size_t num_stripes = 16) {
+    while (num_stripes_ < num_stripes) {
+      num_stripes_ *= 2;
+      shift_--;
+    }
+    stripes_.reset(new stripe[num_stripes_]);
+  }
+
+  concurrent_lazy_map(const concurrent_lazy_map& other)
+    : concurrent_lazy_map(other.num_stripes_) {
+    auto locks = other.lock_all();
+    for (size_t i = 0; i < num_stripes_; i++) {
+      stripes_[i].map = other.stripes_[i].map;
+    }
+  }
+  concurrent_lazy_map& operator=(const concurrent_lazy_map& other) {
+    if (this != &other) *this = concurrent_lazy_map(other);
+    return *this;
+  }
+  // The moved-from map may only be assigned to or destroyed.
+  concurrent_lazy_map(concurrent_lazy_map&&) = default;
+  concurrent_lazy_map& operator=(concurrent_lazy_map&&) = default;
+
+  // Consistent copy of the map as of one instant, i.e. it holds either all
+  // or none of the effects of each write. Independent of this map after.
+  concurrent_lazy_map snapshot() const { return *this; }
+
+  std::optional<V> find(const K& k) const {
+    auto& s = stripe_of(k);
+    std::shared_lock<std::shared_mutex> lock(s.mutex);
+    auto it = s.map.find(k);
+    if (it == s.map.end()) return std::nullopt;
+    return it->second;
+  }
+
+  bool contains(const K& k) const {
+    auto& s = stripe_of(k);
+    std::shared_lock<std::shared_mutex> lock(s.mutex);
+    return s.map.contains(k);
+  }
+
+  template<typename M>
+  void insert_or_assign(const K& k, M&& v) {
+    auto& s = stripe_of(k);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    s.map.insert_or_assign(k, std::forward<M>(v));
+  }
+
+  template<typename M>
+  bool insert(const K& k, M&& v) {
+    auto& s = stripe_of(k);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    return s.map.insert(k, std::forward<M>(v));
+  }
+
+  bool erase(const K& k) {
+    auto& s = stripe_of(k);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    return s.map.erase(k);
+  }
+
+  // Atomic read-modify-write of the value of @k, see lazy_map::update. @f
+  // runs under the lock of the stripe, hence must not call this map.
+  template<typename F>
+  void update(const K& k, F&& f) {
+    auto& s = stripe_of(k);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    s.map.update(k, std::forward<F>(f));
+  }
+
+  // Exact unless there are concurrent writes.
+  size_t size() const {
+    size_t output = 0;
+    for (size_t i = 0; i < num_stripes_; i++) {
+      std::shared_lock<std::shared_mutex> lock(stripes_[i].mutex);
+      output += stripes_[i].map.size();
+    }
+    return output;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  void clear() {
+    for (size_t i = 0; i < num_stripes_; i++) {
+      std::unique_lock<std::shared_mutex> lock(stripes_[i].mutex);
+      stripes_[i].map.clear();
+    }
+  }
+
+  // Detaches each stripe, one at a time, e.g. once the snapshots taken so
+  // far are released.
+  void detach() {
+    for (size_t i = 0; i < num_stripes_; i++) {
+      std::unique_lock<std::shared_mutex> lock(stripes_[i].mutex);
+      stripes_[i].map.detach();
+    }
+  }
+
+  // Calls @f(key, value) on every entry, stripe by stripe. Each stripe is
+  // copied under its lock in O(1) and visited without it, hence @f may call
+  // this map. Not a snapshot of the whole map, see snapshot() for that.
+  template<typename F>
+  void for_each(F&& f) const {
+    for (size_t i = 0; i < num_stripes_; i++) {
+      map_type m = stripe_map(i);
+      for (const auto& kv : m) {
+        f(kv.first, kv.second);
+      }
+    }
+  }
+
+  size_t num_stripes() const { return num_stripes_; }
+
+  // Copy of the @i-th stripe, in O(1).
+  map_type stripe_map(size_t i) const {
+    std::shared_lock<std::shared_mutex> lock(stripes_[i].mutex);
+    return stripes_[i].map;
+  }
+
+ private:
+  // On its own cache line, for writers of neighbouring stripes not to
+  // contend on it.
+  struct alignas(64) stripe {
+    mutable std::shared_mutex mutex;
+    map_type map;
+  };
+
+  // Fibonacci hashing of std::hash, whose low bits are often poor.
+  stripe& stripe_of(const K& k) const {
+    uint64_t h = std::hash<K>()(k) * 0x9E3779B97F4A7C15ull;
+    return stripes_[(shift_ == 64) ? 0 : (h >> shift_)];
+  }
+
+  // Read-locks all the stripes, in order.
+  std::vector<std::shared_lock<std::shared_mutex>> lock_all() const {
+    std::vector<std::shared_lock<std::shared_mutex>> locks;
+    locks.reserve(num_stripes_);
+    for (size_t i = 0; i < num_stripes_; i++) {
+      locks.emplace_back(stripes_[i].mutex);
+    }
+    return locks;
+  }
+
+  std::unique_ptr<stripe[]> stripes_;
+  size_t num_stripes_ = 1;
+  int shift_ = 64;  // 64 - log2(num_stripes_), to pick a stripe by hash.
+};
+
+}  // namespace lazy_map_impl
+
+using lazy_map_impl::concurrent_lazy_map;
+
+}  // namespace quick
+
+#endif  // QUICK_CONCURRENT_LAZY_MAP_HPP_
@@ -0,0 +1,168 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+#include "concurrent_lazy_map.hpp"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using std::vector;
+using quick::concurrent_lazy_map;
+
+TEST(ConcurrentLazyMapTest, Basic) {
+  concurrent_lazy_map<int, std::string> m(5);
+  EXPECT_EQ(8, m.num_stripes());
+  EXPECT_TRUE(m.empty());
+  m.insert_or_assign(1, "a");
+  EXPECT_TRUE(m.insert(2, "b"));
+  EXPECT_FALSE(m.insert(2, "c"));
+  EXPECT_EQ("a", m.find(1).value());
+  EXPECT_FALSE(m.find(3).has_value());
+  EXPECT_TRUE(m.contains(2));
+  auto snapshot = m.snapshot();
+  m.update(1, [](std::string& v) { v += "x"; });
+  EXPECT_THROW(m.update(3, [](std::string&) { }), std::out_of_range);
+  EXPECT_TRUE(m.erase(2));
+  EXPECT_FALSE(m.erase(2));
+  EXPECT_EQ("ax", m.find(1).value());
+  EXPECT_EQ(1, m.size());
+  // The snapshot is unchanged.
+  EXPECT_EQ("a", snapshot.find(1).value());
+  EXPECT_EQ("b", snapshot.find(2).value());
+  EXPECT_EQ(2, snapshot.size());
+  size_t visited = 0;
+  snapshot.for_each([&](int k, const std::string& v) {
+    EXPECT_EQ(v, (k == 1) ? "a" : "b");
+    visited++;
+  });
+  EXPECT_EQ(2, visited);
+  m.detach();
+  m.clear();
+  EXPECT_TRUE(m.empty());
+  EXPECT_EQ(2, snapshot.size());
+  concurrent_lazy_map<int, std::string> single(1);
+  single.insert(7, "x");
+  EXPECT_EQ(1, single.num_stripes());
+  EXPECT_EQ("x", single.find(7).value());
+}
+
+TEST(ConcurrentLazyMapTest, ConcurrentWriters) {
+  concurrent_lazy_map<int, int> m;
+  const int num_threads = 8, num_keys = 2000;
+  vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < num_keys; i++) {
+        int k = t * num_keys + i;
+        m.insert_or_assign(k, k);
+        EXPECT_EQ(k, m.find(k).value());
+        if (i % 2 == 1) m.erase(k - 1);
+      }
+    });
+  }
+  // Readers racing the writers see either nothing or the right value.
+  std::atomic<bool> done{false};
+  std::thread reader([&]() {
+    while (not done) {
+      for (int k = 0; k < num_threads * num_keys; k += 97) {
+        auto v = m.find(k);
+        if (v.has_value()) {
+          EXPECT_EQ(k, *v);
+        }
+      }
+    }
+  });
+  for (auto& t : threads) {
+    t.join();
+  }
+  done = true;
+  reader.join();
+  EXPECT_EQ(num_threads * num_keys / 2, m.size());
+  for (int k = 0; k < num_threads * num_keys; k++) {
+    EXPECT_EQ(k % 2 == 1, m.contains(k));
+  }
+}
+
+TEST(ConcurrentLazyMapTest, SnapshotIsConsistent) {
+  concurrent_lazy_map<int, int> m;
+  const int num_keys = 20000;
+  std::thread writer([&]() {
+    for (int i = 0; i < num_keys; i++) {
+      m.insert_or_assign(i, i);
+    }
+  });
+  // Keys are inserted in order, so a consistent snapshot holds exactly the
+  // keys below its size, though they span all the stripes.
+  size_t last_size = 0;
+  while (last_size < num_keys) {
+    auto s = m.snapshot();
+    size_t size = s.size();
+    EXPECT_LE(last_size, size);
+    size_t num_below = 0;
+    s.for_each([&](int k, int v) {
+      EXPECT_EQ(k, v);
+      num_below += (size_t(k) < size);
+    });
+    ASSERT_EQ(size, num_below);
+    last_size = size;
+  }
+  writer.join();
+}
+
+// Readers copy stripes under their locks, then read and release the copies
+// without. A writer that later finds the head unshared edits it in place,
+// which must be ordered after those reads. Meant to run under
+// ThreadSanitizer too, see run_tests.py --tsan.
+TEST(ConcurrentLazyMapTest, ReadersReleasingCopiesVsWriters) {
+  concurrent_lazy_map<int, std::string> m(4);
+  const int num_keys = 64, num_rounds = 2000;
+  std::atomic<bool> done{false};
+  vector<std::thread> writers;
+  for (int t = 0; t < 2; t++) {
+    writers.emplace_back([&, t]() {
+      for (int i = 0; i < num_rounds; i++) {
+        int k = (i * 7 + t) % num_keys;
+        m.insert_or_assign(k, std::to_string(k));
+        if (i % 3 == 0) m.erase((k + 1) % num_keys);
+        if (i % 5 == 0 and m.contains(k)) {
+          m.update(k, [](std::string& v) { v += ""; });
+        }
+      }
+    });
+  }
+  vector<std::thread> readers;
+  for (int t = 0; t < 2; t++) {
+    readers.emplace_back([&, t]() {
+      while (not done) {
+        if (t == 0) {
+          m.for_each([&](int k, const std::string& v) {
+            EXPECT_EQ(std::to_string(k), v);
+          });
+        } else {
+          auto s = m.snapshot();
+          s.for_each([&](int k, const std::string& v) {
+            EXPECT_EQ(std::to_string(k), v);
+          });
+        }
+      }
+    });
+  }
+  for (auto& t : writers) {
+    t.join();
+  }
+  done = true;
+  for (auto& t : readers) {
+    t.join();
+  }
+  m.for_each([&](int k, const std::string& v) {
+    EXPECT_EQ(std::to_string(k), v);
+  });
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
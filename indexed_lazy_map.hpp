@@ -0,0 +1,129 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+// lazy_map with a secondary index from values to keys.
+
+#ifndef QUICK_INDEXED_LAZY_MAP_HPP_
+#define QUICK_INDEXED_LAZY_MAP_HPP_
+
+#include <cstddef>
+#include <utility>
+
+#include "lazy_map.hpp"
+
+namespace quick {
+namespace lazy_map_impl {
+
+// - A lazy_map<K, V> along with a reverse index from each value to the set
+//   of its keys, for value -> keys lookups.
+// - The index is itself a lazy_map of lazy_maps, made of copy-on-write
+//   fragments like the primary map. Hence copying an indexed_lazy_map is
+//   O(1), and each write updates both maps at the cost of a few lookups.
+// - V must be hashable and equality comparable, same as a key.
+template<typename K, typename V>
+class indexed_lazy_map {
+ public:
+  using map_type = lazy_map<K, V>;
+  // Keys of one value. Its mapped values are always true.
+  using key_set = lazy_map<K, bool>;
+  using index_type = lazy_map<V, key_set>;
+  using key_type = K;
+  using mapped_type = V;
+  using const_iterator = typename map_type::const_iterator;
+  using iterator = const_iterator;
+
+  indexed_lazy_map() = default;
+  indexed_lazy_map(std::initializer_list<typename map_type::value_type> l) {
+    for (const auto& kv : l) {
+      insert_or_assign(kv.first, kv.second);
+    }
+  }
+
+  // Keys whose value is @v, empty if none.
+  const key_set& keys_for(const V& v) const {
+    auto it = index_.find(v);
+    return (it == index_.end()) ? empty_key_set() : it->second;
+  }
+
+  const map_type& map() const { return map_; }
+  const index_type& index() const { return index_; }
+
+  bool contains(const K& k) const { return map_.contains(k); }
+  const V& at(const K& k) const { return map_.at(k); }
+  const V& operator[](const K& k) const { return map_.at(k); }
+  size_t size() const { return map_.size(); }
+  bool empty() const { return map_.empty(); }
+  size_t get_depth() const { return map_.get_depth(); }
+  const_iterator begin() const { return map_.begin(); }
+  const_iterator end() const { return map_.end(); }
+  const_iterator find(const K& k) const { return map_.find(k); }
+
+  bool detach() {
+    bool detached = map_.detach();
+    index_.detach();
+    return detached;
+  }
+
+  void insert_or_assign(const K& k, const V& v) {
+    auto it = map_.find(k);
+    if (it != map_.end()) {
+      if (it->second == v) return;
+      unindex(k, it->second);
+    }
+    index(k, v);
+    map_.insert_or_assign(k, v);
+  }
+
+  bool insert(const K& k, const V& v) {
+    if (map_.contains(k)) return false;
+    index(k, v);
+    map_.insert_or_assign(k, v);
+    return true;
+  }
+
+  bool erase(const K& k) {
+    auto it = map_.find(k);
+    if (it == map_.end()) return false;
+    unindex(k, it->second);
+    map_.erase(k);
+    return true;
+  }
+
+  void clear() {
+    map_.clear();
+    index_.clear();
+  }
+
+ private:
+  void index(const K& k, const V& v) {
+    // Copying a key_set is O(1), moving it out is cheaper still.
+    key_set keys = index_.contains(v) ? index_.move(v) : key_set();
+    keys.insert_or_assign(k, true);
+    index_.insert_or_assign(v, std::move(keys));
+  }
+
+  void unindex(const K& k, const V& v) {
+    key_set keys = index_.move(v);
+    keys.erase(k);
+    if (keys.empty()) {
+      index_.erase(v);
+    } else {
+      index_.insert_or_assign(v, std::move(keys));
+    }
+  }
+
+  static const key_set& empty_key_set() {
+    static const key_set* empty = new key_set();
+    return *empty;
+  }
+
+  map_type map_;
+  index_type index_;
+};
+
+}  // namespace lazy_map_impl
+
+using lazy_map_impl::indexed_lazy_map;
+
+}  // namespace quick
+
+#endif  // QUICK_INDEXED_LAZY_MAP_HPP_
@@ -0,0 +1,76 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+#include "indexed_lazy_map.hpp"
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using std::vector;
+using quick::indexed_lazy_map;
+
+template<typename M>
+std::unordered_set<typename M::key_type> GetKeys(const M& m) {
+  std::unordered_set<typename M::key_type> output;
+  for (auto& it : m) {
+    output.insert(it.first);
+  }
+  return output;
+}
+
+TEST(IndexedLazyMapTest, ReverseLookup) {
+  using Keys = std::unordered_set<std::string>;
+  indexed_lazy_map<std::string, int> m = {{"a", 1}, {"b", 2}, {"c", 1}};
+  EXPECT_EQ((Keys{"a", "c"}), GetKeys(m.keys_for(1)));
+  EXPECT_EQ((Keys{"b"}), GetKeys(m.keys_for(2)));
+  EXPECT_TRUE(m.keys_for(3).empty());
+  auto m2 = m;
+  m2.insert_or_assign("a", 2);
+  m2.insert_or_assign("d", 3);
+  EXPECT_FALSE(m2.insert("d", 4));
+  EXPECT_TRUE(m2.erase("c"));
+  EXPECT_FALSE(m2.erase("c"));
+  EXPECT_TRUE(m2.keys_for(1).empty());
+  EXPECT_FALSE(m2.index().contains(1));
+  EXPECT_EQ((Keys{"a", "b"}), GetKeys(m2.keys_for(2)));
+  EXPECT_EQ((Keys{"d"}), GetKeys(m2.keys_for(3)));
+  // The original is unchanged.
+  EXPECT_EQ((Keys{"a", "c"}), GetKeys(m.keys_for(1)));
+  EXPECT_EQ((Keys{"b"}), GetKeys(m.keys_for(2)));
+  EXPECT_EQ(1, m.at("a"));
+  // Assigning the same value keeps the index as is.
+  m2.insert_or_assign("a", 2);
+  EXPECT_EQ(2, m2.keys_for(2).size());
+  m2.detach();
+  EXPECT_EQ((Keys{"a", "b"}), GetKeys(m2.keys_for(2)));
+  m2.clear();
+  EXPECT_TRUE(m2.keys_for(2).empty());
+  EXPECT_EQ(3, m.size());
+}
+
+TEST(IndexedLazyMapTest, CopiesShareTheIndex) {
+  indexed_lazy_map<int, int> m;
+  for (int i = 0; i < 1000; i++) {
+    m.insert_or_assign(i, i % 10);
+  }
+  vector<indexed_lazy_map<int, int>> history = {m};
+  for (int i = 0; i < 50; i++) {
+    auto next = history.back();
+    next.insert_or_assign(i, 10);
+    history.push_back(next);
+  }
+  EXPECT_EQ(50, history.back().keys_for(10).size());
+  EXPECT_EQ(95, history.back().keys_for(0).size());
+  EXPECT_EQ(100, history[0].keys_for(0).size());
+  EXPECT_EQ(1, history[1].keys_for(10).size());
+  // Each copy shares the index of the previous one, plus one fragment.
+  EXPECT_EQ(history.back().index().get_depth(),
+            history[1].index().get_depth() + 49);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
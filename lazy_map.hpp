@@ -6,47 +6,1294 @@
 #ifndef QUICK_LAZY_MAP_HPP_
 #define QUICK_LAZY_MAP_HPP_
 
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <future>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
+
+// Opt-in operation tracing, see lazy_map_trace.hpp.
+#ifdef QUICK_LAZY_MAP_TRACE
+#include "lazy_map_trace.hpp"
+#define QUICK_LAZY_MAP_TRACE_HOOK(hook, ...) \
+  ::quick::lazy_map_trace::hook(__VA_ARGS__)
+#else
+#define QUICK_LAZY_MAP_TRACE_HOOK(hook, ...)
+#endif
+
+// Opt-in latency histograms, see lazy_map_metrics.hpp.
+#ifdef QUICK_LAZY_MAP_METRICS
+#include "lazy_map_metrics.hpp"
+#define QUICK_LAZY_MAP_TIMER(histogram) \
+  ::quick::lazy_map_metrics::scoped_timer metrics_timer( \
+      ::quick::lazy_map_metrics::registry::global().histogram)
+#define QUICK_LAZY_MAP_LOOKUP_TIMER(k) \
+  ::quick::lazy_map_metrics::lookup_timer metrics_timer( \
+      [&]() { return resolution_depth(head_.get(), k); })
+#else
+#define QUICK_LAZY_MAP_TIMER(histogram)
+#define QUICK_LAZY_MAP_LOOKUP_TIMER(k)
+#endif
 
 namespace quick {
 namespace lazy_map_impl {
 
-constexpr const char* key_error = "[lazy_map]: Key not found";
+constexpr const char* key_error = "[lazy_map]: Key not found";
+constexpr const char* non_copyable_error =
+    "[lazy_map]: Non-copyable value is shared with another map";
+
+template<typename C, typename K>
+bool contains_key(const C& c, const K& k) {
+  return (c.find(k) != c.end());
+}
+
+// Given a mutable map and it's const_iterator, return the mutable iterator
+// corresponding to the given const_iterator.
+// Note: here 'erase' is not doing anything because size of range = 0, since
+// begin == end here. We are abusing 'erase' method to return non-const iter.
+template<typename M>
+typename M::iterator to_non_const_iter(
+    M& m, typename M::const_iterator const_it) {
+  return m.erase(const_it, const_it);
+}
+
+// Does : `dst.insert(src.begin(), src.end())`.
+template<typename S>
+void insert_all(S& dst, const S& src) {
+  dst.insert(src.begin(), src.end());
+}
+
+// Does : `container[k] = v`  in a better way.
+template<typename C, typename K, typename V>
+void put_key_value(C& container, K&& k, V&& v) {
+  auto&& it = container.find(k);
+  if (it == container.end()) {
+    container.emplace(std::forward<K>(k), std::forward<V>(v));
+  } else {
+    it->second = std::forward<V>(v);
+  }
+}
+
+// Uninitialized storage for one object of type T. The owner is responsible
+// for constructing and destroying the object.
+template<typename T>
+struct raw_slot {
+  T* get() { return std::launder(reinterpret_cast<T*>(bytes)); }
+  const T* get() const {
+    return std::launder(reinterpret_cast<const T*>(bytes));
+  }
+  alignas(T) unsigned char bytes[sizeof(T)];
+};
+
+// Whether @p is the only owner of its object, which the caller may then edit
+// in place. The other owners may have been released by other threads, e.g. a
+// snapshot or a detach_async() task that read the object. use_count() is a
+// relaxed load, the acquire orders their reads before the caller's writes.
+template<typename T>
+bool owned_alone(const std::shared_ptr<T>& p) {
+  if (p.use_count() != 1) return false;
+#if defined(__SANITIZE_THREAD__)
+  // ThreadSanitizer doesn't model fences. A copy increments the count with
+  // an acquire-release operation, which it does.
+  auto sync = p;
+#else
+  std::atomic_thread_fence(std::memory_order_acquire);
+#endif
+  return true;
+}
+
+inline size_t count_trailing_zeros(uint64_t w) {
+  return __builtin_ctzll(w);
+}
+
+inline size_t count_ones(uint64_t w) {
+  return __builtin_popcountll(w);
+}
+
+// Approximate heap memory of a node based hash table: the bucket array, and
+// per node the entry plus a next pointer and a cached hash.
+template<typename Table>
+size_t hash_table_bytes(const Table& t) {
+  struct node {
+    void* next;
+    typename Table::value_type entry;
+    size_t hash;
+  };
+  return t.bucket_count() * sizeof(void*) + t.size() * sizeof(node);
+}
+
+// Iterator of a container that keeps its entries either in an array of
+// slots or in a standard hash table, depending on its current layout.
+// `Map` provides: table_type, hashed(), slot(i) and next_slot(i).
+template<typename Map, bool Const>
+class slot_iter {
+  using owner = std::conditional_t<Const, const Map, Map>;
+  using table_type = typename Map::table_type;
+  using table_iter = std::conditional_t<Const,
+                                        typename table_type::const_iterator,
+                                        typename table_type::iterator>;
+ public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = typename Map::value_type;
+  using difference_type = std::ptrdiff_t;
+  using pointer = std::conditional_t<Const, const value_type*, value_type*>;
+  using reference = std::conditional_t<Const, const value_type&, value_type&>;
+
+  slot_iter() = default;
+  // Mutable iterator converts to const iterator.
+  template<bool C = Const, typename = std::enable_if_t<C>>
+  slot_iter(const slot_iter<Map, false>& o)
+    : m_(o.m_), i_(o.i_), it_(o.it_) { }
+
+  reference operator*() const { return *operator->(); }
+  pointer operator->() const {
+    if (m_->hashed()) return &*it_;
+    return m_->slot(i_);
+  }
+  slot_iter& operator++() {
+    if (m_->hashed()) {
+      ++it_;
+    } else {
+      i_ = m_->next_slot(i_);
+    }
+    return *this;
+  }
+  slot_iter operator++(int) {
+    auto old = *this;
+    ++(*this);
+    return old;
+  }
+  bool operator==(const slot_iter& o) const {
+    if (m_ != nullptr && m_->hashed()) return it_ == o.it_;
+    return i_ == o.i_;
+  }
+  bool operator!=(const slot_iter& o) const {
+    return not (*this == o);
+  }
+
+ private:
+  slot_iter(owner* m, size_t i) : m_(m), i_(i) { }
+  slot_iter(owner* m, table_iter it) : m_(m), it_(std::move(it)) { }
+  owner* m_ = nullptr;
+  size_t i_ = 0;
+  table_iter it_;
+  friend Map;
+  template<typename, bool> friend class slot_iter;
+};
+
+// Map for small integer keys such as ids (0..N). Entries are kept in one of
+// three layouts, chosen from how dense the keys are:
+//  - dense: slot `k` of an array holds key `k` and a presence bitmap tells
+//    which slots are live. Lookup is an array index plus a bit test.
+//  - run: a short array of entries sorted by key. This is what a small delta
+//    fragment with scattered keys looks like. Lookup is a binary search.
+//  - hash: a std::unordered_map, used when many keys are far apart.
+// Every insertion and erasure invalidates iterators.
+template<typename V>
+class dense_map {
+  using table_type = std::unordered_map<uint32_t, V>;
+
+ public:
+  using key_type = uint32_t;
+  using mapped_type = V;
+  using value_type = std::pair<const uint32_t, V>;
+  using size_type = size_t;
+  using iterator = slot_iter<dense_map, false>;
+  using const_iterator = slot_iter<dense_map, true>;
+  using node_type = typename table_type::node_type;
+
+  dense_map() = default;
+  dense_map(std::initializer_list<value_type> values)
+    : dense_map(values.begin(), values.end()) { }
+  template<typename InputIt>
+  dense_map(InputIt first, InputIt last) {
+    for (; first != last; ++first) {
+      auto&& kv = *first;
+      try_emplace(kv.first, std::forward<decltype(kv)>(kv).second);
+    }
+  }
+  // Adopts the hash table @table, without copying its entries.
+  explicit dense_map(std::unordered_map<uint32_t, V>&& table)
+    : size_(table.size()), layout_(layout::hash), table_(std::move(table)),
+      max_load_factor_(table_.max_load_factor()) { }
+  dense_map(const dense_map&) = delete;
+  dense_map& operator=(const dense_map&) = delete;
+  ~dense_map() { destroy_all(); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Approximate heap memory, not counting what the entries themselves own.
+  size_t heap_bytes() const {
+    return capacity_ * sizeof(raw_slot<value_type>)
+             + present_.capacity() * sizeof(uint64_t)
+             + hash_table_bytes(table_);
+  }
+
+  iterator begin() {
+    if (layout_ == layout::hash) return iterator(this, table_.begin());
+    return iterator(this, first_index());
+  }
+  const_iterator begin() const {
+    if (layout_ == layout::hash) return const_iterator(this, table_.begin());
+    return const_iterator(this, first_index());
+  }
+  iterator end() {
+    if (layout_ == layout::hash) return iterator(this, table_.end());
+    return iterator(this, limit());
+  }
+  const_iterator end() const {
+    if (layout_ == layout::hash) return const_iterator(this, table_.end());
+    return const_iterator(this, limit());
+  }
+
+  iterator find(uint32_t k) {
+    if (layout_ == layout::hash) return iterator(this, table_.find(k));
+    return iterator(this, index_of(k));
+  }
+
+  const_iterator find(uint32_t k) const {
+    if (layout_ == layout::hash) return const_iterator(this, table_.find(k));
+    return const_iterator(this, index_of(k));
+  }
+
+  size_t count(uint32_t k) const {
+    return (find(k) != end()) ? 1 : 0;
+  }
+
+  template<typename... Args>
+  std::pair<iterator, bool> try_emplace(uint32_t k, Args&&... args) {
+    if (layout_ == layout::hash) {
+      auto r = table_.try_emplace(k, std::forward<Args>(args)...);
+      size_ += r.second ? 1 : 0;
+      return {iterator(this, r.first), r.second};
+    }
+    if (layout_ == layout::dense) {
+      if (k < capacity_) {
+        if (is_present(k)) return {iterator(this, k), false};
+        construct(k, k, std::forward<Args>(args)...);
+        present_[k >> 6] |= (uint64_t(1) << (k & 63));
+        size_++;
+        return {iterator(this, k), true};
+      }
+      if (size_t(k) + 1 <= dense_limit(size_ + 1)) {
+        reallocate(std::max<size_t>(size_t(k) + 1, 2 * capacity_));
+      } else {
+        relayout(size_ < kMaxRun ? layout::run : layout::hash);
+      }
+      return try_emplace(k, std::forward<Args>(args)...);
+    }
+    size_t i = lower_bound(k);
+    if (i < size_ && key_at(i) == k) return {iterator(this, i), false};
+    if (size_ == kMaxRun) {
+      size_t span = size_t(std::max(key_at(size_ - 1), k)) + 1;
+      relayout(span <= dense_limit(size_ + 1) ? layout::dense : layout::hash);
+      return try_emplace(k, std::forward<Args>(args)...);
+    }
+    if (size_ == capacity_) {
+      reallocate(std::min(kMaxRun, std::max<size_t>(4, 2 * capacity_)));
+    }
+    for (size_t j = size_; j > i; j--) {
+      relocate(j - 1, j);
+    }
+    construct(i, k, std::forward<Args>(args)...);
+    size_++;
+    return {iterator(this, i), true};
+  }
+
+  template<typename M>
+  std::pair<iterator, bool> emplace(uint32_t k, M&& v) {
+    return try_emplace(k, std::forward<M>(v));
+  }
+
+  size_t erase(uint32_t k) {
+    if (layout_ == layout::hash) {
+      size_t n = table_.erase(k);
+      size_ -= n;
+      return n;
+    }
+    size_t i = index_of(k);
+    if (i == limit()) return 0;
+    erase_range(i, i + 1);
+    return 1;
+  }
+
+  iterator erase(const_iterator first, const_iterator last) {
+    if (layout_ == layout::hash) {
+      size_t old_size = table_.size();
+      auto it = table_.erase(first.it_, last.it_);
+      size_ -= old_size - table_.size();
+      return iterator(this, it);
+    }
+    erase_range(first.i_, last.i_);
+    return iterator(this, layout_ == layout::run ? first.i_ : last.i_);
+  }
+
+  // Node handle of @k. Only the hash layout has nodes, in other layouts the
+  // node is allocated here.
+  node_type extract(uint32_t k) {
+    if (layout_ == layout::hash) {
+      node_type nh = table_.extract(k);
+      size_ -= nh.empty() ? 0 : 1;
+      return nh;
+    }
+    auto it = find(k);
+    if (it == end()) return node_type();
+    table_type spare;
+    spare.try_emplace(k, std::move(it->second));
+    erase(k);
+    return spare.extract(spare.begin());
+  }
+
+  // Inserts the entry of @nh unless its key is present. Returns false and
+  // leaves @nh untouched otherwise.
+  bool insert(node_type&& nh) {
+    if (nh.empty()) return false;
+    if (layout_ == layout::hash) {
+      auto r = table_.insert(std::move(nh));
+      if (not r.inserted) {
+        nh = std::move(r.node);
+        return false;
+      }
+      size_++;
+      return true;
+    }
+    if (not try_emplace(nh.key(), std::move(nh.mapped())).second) return false;
+    nh = node_type();
+    return true;
+  }
+
+  // Room for @n entries. The dense layout assumes they are the ids 0..n-1.
+  void reserve(size_t n) {
+    if (layout_ == layout::hash) {
+      table_.reserve(n);
+    } else if (n > capacity_ && (layout_ == layout::dense || n <= kMaxRun)) {
+      reallocate(n);
+    }
+  }
+
+  void rehash(size_t n) {
+    if (layout_ == layout::hash) {
+      table_.rehash(n);
+    } else {
+      reserve(n);
+    }
+  }
+
+  float load_factor() const {
+    if (layout_ == layout::hash) return table_.load_factor();
+    return (capacity_ == 0) ? 0 : float(size_) / capacity_;
+  }
+
+  // Applies to the hash layout, also if the map moves to it later.
+  float max_load_factor() const { return max_load_factor_; }
+  void max_load_factor(float ml) {
+    max_load_factor_ = ml;
+    table_.max_load_factor(ml);
+  }
+
+  void clear() {
+    destroy_all();
+    std::fill(present_.begin(), present_.end(), 0);
+    table_.clear();
+    size_ = 0;
+  }
+
+  // Shrinks the slot array to the entries, and moves a hash layout back to
+  // the dense or run layout if its keys allow one.
+  void seal() {
+    if (layout_ == layout::hash) {
+      size_t span = 0;
+      for (auto& kv : table_) span = std::max<size_t>(span, kv.first + 1);
+      if (span <= dense_limit(size_)) {
+        relayout(layout::dense, span);
+      } else if (size_ <= kMaxRun) {
+        relayout(layout::run, size_);
+      } else {
+        table_.rehash(0);
+      }
+      return;
+    }
+    size_t n = size_;
+    if (layout_ == layout::dense) {
+      n = 0;
+      for (size_t i = next_present(0); i < capacity_; i = next_present(i + 1)) {
+        n = i + 1;
+      }
+    }
+    if (n < capacity_) {
+      reallocate(n);
+      present_.shrink_to_fit();
+    }
+  }
+
+ private:
+  enum class layout : uint8_t { dense, run, hash };
+  // Max number of entries in the `run` layout.
+  static constexpr size_t kMaxRun = 64;
+
+  // Largest array a dense layout with @n entries is allowed to use.
+  static size_t dense_limit(size_t n) { return 64 + 4 * n; }
+
+  template<typename, bool> friend class slot_iter;
+
+  bool hashed() const { return layout_ == layout::hash; }
+  value_type* slot(size_t i) { return slots_[i].get(); }
+  const value_type* slot(size_t i) const { return slots_[i].get(); }
+  size_t next_slot(size_t i) const {
+    return (layout_ == layout::dense) ? next_present(i + 1) : i + 1;
+  }
+
+  size_t limit() const {
+    return (layout_ == layout::dense) ? capacity_ : size_;
+  }
+
+  // Not for hash layout.
+  size_t first_index() const {
+    return (layout_ == layout::dense) ? next_present(0) : 0;
+  }
+
+  bool is_present(size_t i) const {
+    return (present_[i >> 6] >> (i & 63)) & 1;
+  }
+
+  size_t next_present(size_t i) const {
+    while (i < capacity_) {
+      uint64_t w = present_[i >> 6] >> (i & 63);
+      if (w != 0) return i + count_trailing_zeros(w);
+      i = (i | 63) + 1;
+    }
+    return capacity_;
+  }
+
+  uint32_t key_at(size_t i) const { return slots_[i].get()->first; }
+
+  size_t lower_bound(uint32_t k) const {
+    size_t lo = 0, hi = size_;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (key_at(mid) < k) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+  }
+
+  // Slot index holding @k, or limit() if absent. Not for hash layout.
+  size_t index_of(uint32_t k) const {
+    if (layout_ == layout::dense) {
+      return (k < capacity_ && is_present(k)) ? k : capacity_;
+    }
+    size_t i = lower_bound(k);
+    return (i < size_ && key_at(i) == k) ? i : size_;
+  }
+
+  template<typename... Args>
+  void construct(size_t i, uint32_t k, Args&&... args) {
+    new (slots_[i].bytes) value_type(
+        std::piecewise_construct,
+        std::forward_as_tuple(k),
+        std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+
+  // Moves the entry in slot @from to the uninitialized slot @to.
+  void relocate(size_t from, size_t to) {
+    new (slots_[to].bytes) value_type(std::move(*slots_[from].get()));
+    slots_[from].get()->~value_type();
+  }
+
+  // Destroys the entries in slots [a, b).
+  void erase_range(size_t a, size_t b) {
+    if (a == b) return;
+    if (layout_ == layout::dense) {
+      for (size_t i = next_present(a); i < b; i = next_present(i + 1)) {
+        slots_[i].get()->~value_type();
+        present_[i >> 6] &= ~(uint64_t(1) << (i & 63));
+        size_--;
+      }
+      return;
+    }
+    for (size_t i = a; i < b; i++) {
+      slots_[i].get()->~value_type();
+    }
+    for (size_t i = b; i < size_; i++) {
+      relocate(i, i - (b - a));
+    }
+    size_ -= (b - a);
+  }
+
+  void destroy_all() {
+    if (layout_ == layout::hash) return;
+    for (size_t i = first_index(); i < limit(); ) {
+      slots_[i].get()->~value_type();
+      i = (layout_ == layout::dense) ? next_present(i + 1) : i + 1;
+    }
+  }
+
+  // Moves the slot array to a new one of @new_capacity slots. Entries keep
+  // their slot index.
+  void reallocate(size_t new_capacity) {
+    std::unique_ptr<raw_slot<value_type>[]> old = std::move(slots_);
+    slots_.reset(new raw_slot<value_type>[new_capacity]);
+    if (layout_ == layout::dense) {
+      for (size_t i = next_present(0); i < capacity_; i = next_present(i + 1)) {
+        new (slots_[i].bytes) value_type(std::move(*old[i].get()));
+        old[i].get()->~value_type();
+      }
+      present_.resize((new_capacity + 63) / 64, 0);
+    } else {
+      for (size_t i = 0; i < size_; i++) {
+        new (slots_[i].bytes) value_type(std::move(*old[i].get()));
+        old[i].get()->~value_type();
+      }
+    }
+    capacity_ = new_capacity;
+  }
+
+  // Moves all entries into a fresh map of the given layout, with an initial
+  // slot array of @capacity.
+  void relayout(layout target, size_t capacity = 0) {
+    dense_map other;
+    other.layout_ = target;
+    other.max_load_factor(max_load_factor_);
+    if (capacity > 0) other.reallocate(capacity);
+    for (auto& kv : *this) {
+      other.try_emplace(kv.first, std::move(kv.second));
+    }
+    swap(other);
+  }
+
+  void swap(dense_map& o) {
+    std::swap(slots_, o.slots_);
+    std::swap(present_, o.present_);
+    std::swap(capacity_, o.capacity_);
+    std::swap(size_, o.size_);
+    std::swap(layout_, o.layout_);
+    std::swap(table_, o.table_);
+    std::swap(max_load_factor_, o.max_load_factor_);
+  }
+
+  std::unique_ptr<raw_slot<value_type>[]> slots_;
+  // Presence bitmap of slots_, used in dense layout only.
+  std::vector<uint64_t> present_;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+  layout layout_ = layout::dense;
+  table_type table_;
+  float max_load_factor_ = 1;
+};
+
+// Set of integer keys, stored as 64-bit bitmap blocks in an open addressing
+// table keyed by `key >> 6`. Clustered keys cost about one bit each and
+// scattered keys 16 to 32 bytes. Membership test and insertion hash the block
+// number once, however scattered the keys are.
+// Every insertion and erasure invalidates iterators.
+template<typename K>
+class bitmap_set {
+  using ukey = std::make_unsigned_t<K>;
+  // A cell with no bits set is empty.
+  struct block {
+    ukey base;  // key >> 6
+    uint64_t bits;
+  };
+
+ public:
+  using key_type = K;
+  using value_type = K;
+  using size_type = size_t;
+
+  class const_iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = K;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const K*;
+    using reference = K;
+
+    const_iterator() = default;
+    K operator*() const {
+      return static_cast<K>(
+          static_cast<ukey>((s_->blocks_[b_].base << 6) | bit_));
+    }
+    const_iterator& operator++() {
+      uint64_t rest = s_->blocks_[b_].bits & ~((uint64_t(2) << bit_) - 1);
+      if (rest != 0) {
+        bit_ = count_trailing_zeros(rest);
+      } else {
+        b_ = s_->next_block(b_ + 1);
+        bit_ = (b_ < s_->blocks_.size())
+                 ? count_trailing_zeros(s_->blocks_[b_].bits) : 0;
+      }
+      return *this;
+    }
+    const_iterator operator++(int) {
+      auto old = *this;
+      ++(*this);
+      return old;
+    }
+    bool operator==(const const_iterator& o) const {
+      return b_ == o.b_ && bit_ == o.bit_;
+    }
+    bool operator!=(const const_iterator& o) const {
+      return not (*this == o);
+    }
+
+   private:
+    const_iterator(const bitmap_set* s, size_t b, size_t bit)
+      : s_(s), b_(b), bit_(bit) { }
+    const bitmap_set* s_ = nullptr;
+    size_t b_ = 0;
+    size_t bit_ = 0;
+    friend class bitmap_set;
+  };
+  using iterator = const_iterator;
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  size_t heap_bytes() const { return blocks_.capacity() * sizeof(block); }
+
+  const_iterator begin() const {
+    size_t b = next_block(0);
+    if (b == blocks_.size()) return end();
+    return const_iterator(this, b, count_trailing_zeros(blocks_[b].bits));
+  }
+  const_iterator end() const {
+    return const_iterator(this, blocks_.size(), 0);
+  }
+
+  const_iterator find(const K& k) const {
+    if (not contains(k)) return end();
+    return const_iterator(this, cell_of(base_of(k)), bit_of(k));
+  }
+
+  size_t count(const K& k) const {
+    return contains(k) ? 1 : 0;
+  }
+
+  bool contains(const K& k) const {
+    if (blocks_.empty()) return false;
+    return (blocks_[cell_of(base_of(k))].bits >> bit_of(k)) & 1;
+  }
+
+  std::pair<const_iterator, bool> insert(const K& k) {
+    // Kept at most half full.
+    if (2 * (num_blocks_ + 1) > blocks_.size()) {
+      resize(std::max<size_t>(8, 2 * blocks_.size()));
+    }
+    size_t b = cell_of(base_of(k));
+    if (blocks_[b].bits == 0) {
+      blocks_[b].base = base_of(k);
+      num_blocks_++;
+    }
+    uint64_t mask = uint64_t(1) << bit_of(k);
+    bool inserted = (blocks_[b].bits & mask) == 0;
+    blocks_[b].bits |= mask;
+    size_ += inserted ? 1 : 0;
+    return {const_iterator(this, b, bit_of(k)), inserted};
+  }
+
+  template<typename InputIt>
+  void insert(InputIt first, InputIt last) {
+    for (; first != last; ++first) {
+      insert(*first);
+    }
+  }
+
+  // Inserts all keys of @other, a block at a time.
+  void insert(const bitmap_set& other) {
+    size_t needed = num_blocks_ + other.num_blocks_;
+    if (2 * needed > blocks_.size()) resize(table_size(needed));
+    for (const block& o : other.blocks_) {
+      if (o.bits == 0) continue;
+      size_t b = cell_of(o.base);
+      if (blocks_[b].bits == 0) {
+        blocks_[b].base = o.base;
+        num_blocks_++;
+      }
+      size_ += count_ones(o.bits & ~blocks_[b].bits);
+      blocks_[b].bits |= o.bits;
+    }
+  }
+
+  size_t erase(const K& k) {
+    if (blocks_.empty()) return 0;
+    size_t b = cell_of(base_of(k));
+    uint64_t mask = uint64_t(1) << bit_of(k);
+    if ((blocks_[b].bits & mask) == 0) return 0;
+    blocks_[b].bits &= ~mask;
+    if (blocks_[b].bits == 0) {
+      num_blocks_--;
+      close_gap(b);
+    }
+    size_--;
+    return 1;
+  }
+
+  void clear() {
+    std::fill(blocks_.begin(), blocks_.end(), block{0, 0});
+    num_blocks_ = 0;
+    size_ = 0;
+  }
+
+  // Shrinks the table to the blocks.
+  void seal() {
+    if (num_blocks_ == 0) {
+      std::vector<block>().swap(blocks_);
+    } else if (table_size(num_blocks_) < blocks_.size()) {
+      resize(table_size(num_blocks_));
+    }
+  }
+
+ private:
+  static ukey base_of(const K& k) { return static_cast<ukey>(k) >> 6; }
+  static size_t bit_of(const K& k) { return static_cast<ukey>(k) & 63; }
+
+  // Smallest power of two table keeping @n blocks at most half full.
+  static size_t table_size(size_t n) {
+    size_t size = 8;
+    while (size < 2 * n) size *= 2;
+    return size;
+  }
+
+  // Fibonacci hashing, so that consecutive blocks spread over the table.
+  size_t home_of(ukey base) const {
+    return size_t((uint64_t(base) * 0x9E3779B97F4A7C15ull) >> shift_);
+  }
+
+  // Cell holding block @base, or the empty cell where it would go.
+  size_t cell_of(ukey base) const {
+    size_t mask = blocks_.size() - 1;
+    size_t b = home_of(base);
+    while (blocks_[b].bits != 0 && blocks_[b].base != base) {
+      b = (b + 1) & mask;
+    }
+    return b;
+  }
+
+  size_t next_block(size_t b) const {
+    while (b < blocks_.size() && blocks_[b].bits == 0) b++;
+    return b;
+  }
+
+  // Backward shift deletion: moves the blocks probed past the emptied cell
+  // @hole back, so that lookups never stop early.
+  void close_gap(size_t hole) {
+    size_t mask = blocks_.size() - 1;
+    for (size_t b = (hole + 1) & mask; blocks_[b].bits != 0;
+         b = (b + 1) & mask) {
+      size_t home = home_of(blocks_[b].base);
+      // The block stays if its home lies cyclically in (hole, b].
+      if (((b - home) & mask) >= ((b - hole) & mask)) {
+        blocks_[hole] = blocks_[b];
+        blocks_[b].bits = 0;
+        hole = b;
+      }
+    }
+  }
+
+  void resize(size_t new_size) {
+    std::vector<block> old(new_size, block{0, 0});
+    old.swap(blocks_);
+    shift_ = 64;
+    for (size_t n = new_size; n > 1; n /= 2) shift_--;
+    for (const block& o : old) {
+      if (o.bits != 0) blocks_[cell_of(o.base)] = o;
+    }
+  }
+
+  std::vector<block> blocks_;
+  size_t num_blocks_ = 0;
+  size_t size_ = 0;
+  unsigned shift_ = 64;
+};
+
+// Number of entries a fragment container keeps inline, for a budget of
+// about 256 bytes. Large values are never inlined.
+template<typename T>
+constexpr size_t inline_capacity = std::min<size_t>(8, 256 / sizeof(T));
+
+// Map that keeps up to N entries inline and finds them by linear scan. It
+// moves them to a std::unordered_map once it grows past N entries. Most
+// fragments are deltas with a handful of keys, for which this saves the hash
+// node and bucket array allocations.
+// seal() turns a grown map into a flat layout for reading: entries in one
+// exactly sized array, found through an open addressing index. The first
+// write afterwards moves them back to a hash table.
+// Every insertion and erasure invalidates iterators.
+template<typename K, typename V, size_t N>
+class small_map {
+  using table_type = std::unordered_map<K, V>;
+
+ public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<const K, V>;
+  using size_type = size_t;
+  using iterator = slot_iter<small_map, false>;
+  using const_iterator = slot_iter<small_map, true>;
+  using node_type = typename table_type::node_type;
+
+  small_map() = default;
+  small_map(std::initializer_list<value_type> values)
+    : small_map(values.begin(), values.end()) { }
+  template<typename InputIt>
+  small_map(InputIt first, InputIt last) {
+    for (; first != last; ++first) {
+      auto&& kv = *first;
+      try_emplace(kv.first, std::forward<decltype(kv)>(kv).second);
+    }
+  }
+  // Adopts the hash table @table, without copying its entries.
+  explicit small_map(table_type&& table)
+    : hashed_(true), table_(std::move(table)) { }
+  small_map(const small_map&) = delete;
+  small_map& operator=(const small_map&) = delete;
+  ~small_map() { destroy_slots(); }
+
+  size_t size() const { return hashed_ ? table_.size() : n_; }
+  bool empty() const { return size() == 0; }
+
+  // Whether the entries are in the flat layout built by seal().
+  bool flat() const { return flat_ != nullptr; }
+
+  // Approximate heap memory, not counting what the entries themselves own.
+  // Inline entries are part of the map object.
+  size_t heap_bytes() const {
+    size_t flat = flat_ ? n_ * sizeof(raw_slot<value_type>)
+                            + index_.capacity() * sizeof(uint32_t) : 0;
+    return flat + hash_table_bytes(table_);
+  }
+
+  iterator begin() {
+    return hashed_ ? iterator(this, table_.begin()) : iterator(this, 0);
+  }
+  const_iterator begin() const {
+    return hashed_ ? const_iterator(this, table_.begin())
+                   : const_iterator(this, 0);
+  }
+  iterator end() {
+    return hashed_ ? iterator(this, table_.end()) : iterator(this, n_);
+  }
+  const_iterator end() const {
+    return hashed_ ? const_iterator(this, table_.end())
+                   : const_iterator(this, n_);
+  }
+
+  iterator find(const K& k) {
+    if (hashed_) return iterator(this, table_.find(k));
+    return iterator(this, index_of(k));
+  }
+
+  const_iterator find(const K& k) const {
+    if (hashed_) return const_iterator(this, table_.find(k));
+    return const_iterator(this, index_of(k));
+  }
+
+  size_t count(const K& k) const {
+    return hashed_ ? table_.count(k) : (index_of(k) < n_ ? 1 : 0);
+  }
+
+  template<typename... Args>
+  std::pair<iterator, bool> try_emplace(const K& k, Args&&... args) {
+    if (flat_) {
+      size_t i = index_of(k);
+      if (i < n_) return {iterator(this, i), false};
+      move_to_table();
+    }
+    if (not hashed_) {
+      size_t i = index_of(k);
+      if (i < n_) return {iterator(this, i), false};
+      if (n_ < N) {
+        new (slots_[n_].bytes) value_type(
+            std::piecewise_construct,
+            std::forward_as_tuple(k),
+            std::forward_as_tuple(std::forward<Args>(args)...));
+        return {iterator(this, n_++), true};
+      }
+      move_to_table();
+    }
+    auto r = table_.try_emplace(k, std::forward<Args>(args)...);
+    return {iterator(this, r.first), r.second};
+  }
+
+  template<typename M>
+  std::pair<iterator, bool> emplace(const K& k, M&& v) {
+    return try_emplace(k, std::forward<M>(v));
+  }
+
+  size_t erase(const K& k) {
+    if (flat_) move_to_table();
+    if (hashed_) return table_.erase(k);
+    size_t i = index_of(k);
+    if (i == n_) return 0;
+    erase_slots(i, i + 1);
+    return 1;
+  }
+
+  iterator erase(const_iterator first, const_iterator last) {
+    if (flat_ && first != last) {
+      // Slot numbers don't survive the move to a hash table, keys do.
+      std::vector<K> keys;
+      for (size_t i = first.i_; i < last.i_; i++) {
+        keys.push_back(slot(i)->first);
+      }
+      std::optional<K> next;
+      if (last.i_ < n_) next = slot(last.i_)->first;
+      move_to_table();
+      for (auto& k : keys) table_.erase(k);
+      return next ? find(*next) : end();
+    }
+    if (hashed_) return iterator(this, table_.erase(first.it_, last.it_));
+    erase_slots(first.i_, last.i_);
+    return iterator(this, first.i_);
+  }
+
+  // Node handle of @k. Inline entries have no node, one is allocated here.
+  node_type extract(const K& k) {
+    if (flat_) move_to_table();
+    if (hashed_) return table_.extract(k);
+    size_t i = index_of(k);
+    if (i == n_) return node_type();
+    table_type spare;
+    spare.try_emplace(k, std::move(slot(i)->second));
+    erase_slots(i, i + 1);
+    return spare.extract(spare.begin());
+  }
+
+  // Inserts the entry of @nh unless its key is present. Returns false and
+  // leaves @nh untouched otherwise.
+  bool insert(node_type&& nh) {
+    if (nh.empty()) return false;
+    if (not hashed_) {
+      if (index_of(nh.key()) < n_) return false;
+      if (n_ < N && not flat_) {
+        try_emplace(nh.key(), std::move(nh.mapped()));
+        nh = node_type();
+        return true;
+      }
+      move_to_table();
+    }
+    auto r = table_.insert(std::move(nh));
+    if (not r.inserted) nh = std::move(r.node);
+    return r.inserted;
+  }
+
+  void reserve(size_t n) {
+    if ((n > N || flat_) && not hashed_) move_to_table();
+    if (hashed_) table_.reserve(n);
+  }
+
+  void rehash(size_t n) {
+    if ((n > N || flat_) && not hashed_) move_to_table();
+    if (hashed_) table_.rehash(n);
+  }
+
+  float load_factor() const {
+    if (hashed_) return table_.load_factor();
+    if (flat_) return float(n_) / index_.size();
+    return float(n_) / N;
+  }
+
+  // Applies to the hash table, also if the entries are still inline.
+  float max_load_factor() const { return table_.max_load_factor(); }
+  void max_load_factor(float ml) { table_.max_load_factor(ml); }
+
+  void clear() {
+    destroy_slots();
+    table_.clear();
+  }
+
+  // Rebuilds a grown map into the flat layout, or back inline if its entries
+  // fit there again. Releases the hash nodes and buckets either way.
+  void seal() {
+    if (not hashed_) return;
+    float ml = table_.max_load_factor();
+    if (table_.size() > N) {
+      flat_.reset(new raw_slot<value_type>[table_.size()]);
+    }
+    for (auto& kv : table_) {
+      new (slot_bytes(n_)) value_type(kv.first, std::move(kv.second));
+      n_++;
+    }
+    table_type().swap(table_);
+    table_.max_load_factor(ml);
+    hashed_ = false;
+    if (flat_) build_index();
+  }
+
+ private:
+  template<typename, bool> friend class slot_iter;
+
+  bool hashed() const { return hashed_; }
+  value_type* slot(size_t i) {
+    return flat_ ? flat_[i].get() : slots_[i].get();
+  }
+  const value_type* slot(size_t i) const {
+    return flat_ ? flat_[i].get() : slots_[i].get();
+  }
+  size_t next_slot(size_t i) const { return i + 1; }
+  void* slot_bytes(size_t i) {
+    return flat_ ? flat_[i].bytes : slots_[i].bytes;
+  }
+
+  size_t index_of(const K& k) const {
+    if (flat_) {
+      size_t mask = index_.size() - 1;
+      for (size_t h = index_cell(k); index_[h] != 0; h = (h + 1) & mask) {
+        if (slot(index_[h] - 1)->first == k) return index_[h] - 1;
+      }
+      return n_;
+    }
+    size_t i = 0;
+    while (i < n_ && not (slots_[i].get()->first == k)) i++;
+    return i;
+  }
+
+  // Fibonacci hashing spreads the low entropy bits of identity and pointer
+  // hashes over the whole index.
+  size_t index_cell(const K& k) const {
+    uint64_t h = std::hash<K>()(k) * 0x9E3779B97F4A7C15ull;
+    return size_t(h >> index_shift_);
+  }
+
+  // Index of slot numbers plus one, 0 marks an empty cell. Kept at most
+  // half full.
+  void build_index() {
+    size_t bits = 1;
+    while ((size_t(1) << bits) < 2 * n_) bits++;
+    index_.assign(size_t(1) << bits, 0);
+    index_shift_ = 64 - bits;
+    size_t mask = index_.size() - 1;
+    for (size_t i = 0; i < n_; i++) {
+      size_t h = index_cell(slot(i)->first);
+      while (index_[h] != 0) h = (h + 1) & mask;
+      index_[h] = uint32_t(i + 1);
+    }
+  }
+
+  void move_to_table() {
+    table_.reserve(n_ + 1);
+    for (size_t i = 0; i < n_; i++) {
+      auto& kv = *slot(i);
+      table_.try_emplace(kv.first, std::move(kv.second));
+    }
+    destroy_slots();
+    hashed_ = true;
+  }
+
+  // Erases the inline entries [a, b), keeping the order of the rest.
+  void erase_slots(size_t a, size_t b) {
+    if (a == b) return;
+    for (size_t i = a; i < b; i++) {
+      slot(i)->~value_type();
+    }
+    for (size_t i = b; i < n_; i++) {
+      new (slot_bytes(i - (b - a))) value_type(std::move(*slot(i)));
+      slot(i)->~value_type();
+    }
+    n_ -= (b - a);
+  }
+
+  // Destroys the inline or flat entries, and drops the flat layout.
+  void destroy_slots() {
+    for (size_t i = 0; i < n_; i++) {
+      slot(i)->~value_type();
+    }
+    n_ = 0;
+    flat_.reset();
+    index_.clear();
+  }
+
+  std::array<raw_slot<value_type>, N> slots_;
+  size_t n_ = 0;  // Number of inline or flat entries.
+  bool hashed_ = (N == 0);
+  table_type table_;
+  // Flat layout, only after seal().
+  std::unique_ptr<raw_slot<value_type>[]> flat_;
+  std::vector<uint32_t> index_;
+  unsigned index_shift_ = 63;
+};
+
+// Set counterpart of small_map.
+template<typename K, size_t N>
+class small_set {
+  using table_type = std::unordered_set<K>;
+
+ public:
+  using key_type = K;
+  using value_type = K;
+  using size_type = size_t;
+  using const_iterator = slot_iter<small_set, true>;
+  using iterator = const_iterator;
+
+  small_set() = default;
+  small_set(const small_set&) = delete;
+  small_set& operator=(const small_set&) = delete;
+  ~small_set() { destroy_inline(); }
+
+  size_t size() const { return hashed_ ? table_.size() : n_; }
+  bool empty() const { return size() == 0; }
+
+  size_t heap_bytes() const { return hash_table_bytes(table_); }
+
+  const_iterator begin() const {
+    return hashed_ ? const_iterator(this, table_.begin())
+                   : const_iterator(this, 0);
+  }
+  const_iterator end() const {
+    return hashed_ ? const_iterator(this, table_.end())
+                   : const_iterator(this, n_);
+  }
+
+  const_iterator find(const K& k) const {
+    if (hashed_) return const_iterator(this, table_.find(k));
+    return const_iterator(this, index_of(k));
+  }
+
+  size_t count(const K& k) const {
+    return hashed_ ? table_.count(k) : (index_of(k) < n_ ? 1 : 0);
+  }
+
+  std::pair<const_iterator, bool> insert(const K& k) {
+    if (not hashed_) {
+      size_t i = index_of(k);
+      if (i < n_) return {const_iterator(this, i), false};
+      if (n_ < N) {
+        new (slots_[n_].bytes) K(k);
+        return {const_iterator(this, n_++), true};
+      }
+      move_to_table();
+    }
+    auto r = table_.insert(k);
+    return {const_iterator(this, r.first), r.second};
+  }
+
+  template<typename InputIt>
+  void insert(InputIt first, InputIt last) {
+    for (; first != last; ++first) {
+      insert(*first);
+    }
+  }
+
+  size_t erase(const K& k) {
+    if (hashed_) return table_.erase(k);
+    size_t i = index_of(k);
+    if (i == n_) return 0;
+    slots_[i].get()->~K();
+    for (size_t j = i + 1; j < n_; j++) {
+      new (slots_[j - 1].bytes) K(std::move(*slots_[j].get()));
+      slots_[j].get()->~K();
+    }
+    n_--;
+    return 1;
+  }
 
-template<typename C, typename K>
-bool contains_key(const C& c, const K& k) {
-  return (c.find(k) != c.end());
-}
+  void clear() {
+    destroy_inline();
+    table_.clear();
+  }
 
-// Given a mutable map and it's const_iterator, return the mutable iterator
-// corresponding to the given const_iterator.
-// Note: here 'erase' is not doing anything because size of range = 0, since
-// begin == end here. We are abusing 'erase' method to return non-const iter.
-template<typename M>
-typename M::iterator to_non_const_iter(
-    M& m, typename M::const_iterator const_it) {
-  return m.erase(const_it, const_it);
-}
+  // Moves the keys back inline if they fit there again, otherwise shrinks
+  // the bucket array to the number of keys.
+  void seal() {
+    if (not hashed_) return;
+    if (table_.size() > N) {
+      table_.rehash(0);
+      return;
+    }
+    for (auto& k : table_) {
+      new (slots_[n_++].bytes) K(k);
+    }
+    table_type().swap(table_);
+    hashed_ = false;
+  }
 
-// Does : `container[k] = v`  in a better way.
-template<typename C, typename K, typename V>
-void put_key_value(C& container, K&& k, V&& v) {
-  auto&& it = container.find(k);
-  if (it == container.end()) {
-    container.emplace(std::forward<K>(k), std::forward<V>(v));
-  } else {
-    it->second = std::forward<V>(v);
+ private:
+  template<typename, bool> friend class slot_iter;
+
+  bool hashed() const { return hashed_; }
+  const K* slot(size_t i) const { return slots_[i].get(); }
+  size_t next_slot(size_t i) const { return i + 1; }
+
+  size_t index_of(const K& k) const {
+    size_t i = 0;
+    while (i < n_ && not (*slots_[i].get() == k)) i++;
+    return i;
   }
+
+  void move_to_table() {
+    table_.reserve(n_ + 1);
+    for (size_t i = 0; i < n_; i++) {
+      table_.insert(std::move(*slots_[i].get()));
+    }
+    destroy_inline();
+    hashed_ = true;
+  }
+
+  void destroy_inline() {
+    for (size_t i = 0; i < n_; i++) {
+      slots_[i].get()->~K();
+    }
+    n_ = 0;
+  }
+
+  std::array<raw_slot<K>, N> slots_;
+  size_t n_ = 0;  // Number of inline keys.
+  bool hashed_ = (N == 0);
+  table_type table_;
+};
+
+template<typename K>
+bool contains_key(const bitmap_set<K>& c, const K& k) {
+  return c.contains(k);
+}
+
+template<typename K>
+void insert_all(bitmap_set<K>& dst, const bitmap_set<K>& src) {
+  dst.insert(src);
 }
 
+// Deleted keys of a fragment. Integer keys are recorded in a bitmap, which
+// is far more compact than a node per key in a std::unordered_set.
+template<typename K>
+using tombstone_set = std::conditional_t<
+    std::is_integral<K>::value and not std::is_same<K, bool>::value,
+    bitmap_set<K>,
+    small_set<K, inline_capacity<K>>>;
+
+// Containers backing the fragments of a lazy_map<K, V>.
+template<typename K, typename V>
+struct fragment_storage {
+  using map_type = small_map<K, V, inline_capacity<std::pair<const K, V>>>;
+  using set_type = tombstone_set<K>;
+};
+
+// Keys of lazy_map<uint32_t, V> are expected to be small dense ids, so they
+// are array-indexed instead of hashed.
+template<typename V>
+struct fragment_storage<uint32_t, V> {
+  using map_type = dense_map<V>;
+  using set_type = tombstone_set<uint32_t>;
+};
+
 template<typename K, typename V>
 class lazy_map {
   class const_iter_impl;
-  using underlying_map = typename std::unordered_map<K, V>;
+  using underlying_map = typename fragment_storage<K, V>::map_type;
+  using underlying_set = typename fragment_storage<K, V>::set_type;
   using underlying_const_iter = typename underlying_map::const_iterator;
   struct Fragment;
 
@@ -58,14 +1305,49 @@ class lazy_map {
   using iterator = const_iterator;
   using reference = value_type&;
   using const_reference = const value_type&;
-  lazy_map() : head_(std::make_shared<Fragment>()) { }
+  // Node handles are interchangeable with the ones of std::unordered_map.
+  using node_type = typename std::unordered_map<K, V>::node_type;
+  // Doesn't allocate, the first write does.
+  lazy_map() : head_(empty_fragment()) { }
+  lazy_map(const lazy_map& other) : head_(other.head_) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_copy, this, &other);
+  }
+  lazy_map& operator=(const lazy_map& other) {
+    head_ = other.head_;
+    QUICK_LAZY_MAP_TRACE_HOOK(on_copy, this, &other);
+    return *this;
+  }
+  // The moved-from map is left empty and valid.
+  lazy_map(lazy_map&& other) noexcept
+    : head_(std::exchange(other.head_, empty_fragment())) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_move, this, &other);
+  }
+  lazy_map& operator=(lazy_map&& other) noexcept {
+    head_ = std::exchange(other.head_, empty_fragment());
+    QUICK_LAZY_MAP_TRACE_HOOK(on_move, this, &other);
+    return *this;
+  }
+  ~lazy_map() {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_destroy, this);
+  }
   lazy_map(std::initializer_list<value_type> values)
-    : head_(std::make_shared<Fragment>(values)) { }
+    : head_(std::make_shared<Fragment>(values)) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_construct, this, *this);
+  }
   template<typename InputIt>
   lazy_map(InputIt first, InputIt last)
-    : head_(std::make_shared<Fragment>(first, last)) { }
+    : head_(std::make_shared<Fragment>(first, last)) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_construct, this, *this);
+  }
+  // Takes over the hash table of @other_map, without copying its entries.
+  explicit lazy_map(std::unordered_map<K, V>&& other_map)
+    : head_(std::make_shared<Fragment>(std::move(other_map))) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_construct, this, *this);
+  }
 
   bool detach() {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_detach, this);
+    QUICK_LAZY_MAP_TIMER(detach);
     prepare_for_edit();
     return detach_internal();
   }
@@ -74,7 +1356,70 @@ class lazy_map {
     return (head_->parent() == nullptr);
   }
 
+  // Flat root computed by detach_async, for complete_detach.
+  class detached_root {
+   public:
+    detached_root() = default;
+
+   private:
+    friend class lazy_map;
+    detached_root(std::shared_ptr<Fragment> source,
+                  std::shared_ptr<Fragment> root)
+      : source_(std::move(source)), root_(std::move(root)) { }
+    std::shared_ptr<Fragment> source_;  // Head at the time of detach_async.
+    std::shared_ptr<Fragment> root_;
+  };
+
+  // - Detaches the map in the background: computes the absolute value of the
+  //   current head as a new root, in a task handed to @executor, which is
+  //   called with a nullary function object, e.g. to post it to a thread
+  //   pool. The map stays usable meanwhile: the snapshotted fragments are
+  //   shared, hence immutable, and new writes go to fresh fragments above.
+  // - Pass the result to complete_detach, from the thread owning the map.
+  // - Doesn't compile for non-copyable values, the task copies them all.
+  template<typename Executor>
+  std::future<detached_root> detach_async(Executor&& executor) {
+    static_assert(std::is_copy_constructible<V>::value,
+                  "[lazy_map]: detach_async copies the values");
+    auto task = std::make_shared<std::packaged_task<detached_root()>>(
+        [source = head_]() {
+          auto root = std::make_shared<Fragment>(
+              std::shared_ptr<Fragment>(source));
+          root->key_values_.reserve(root->size_);
+          merge_into(*root, nullptr);
+          return detached_root(source, std::move(root));
+        });
+    auto result = task->get_future();
+    executor([task]() { (*task)(); });
+    return result;
+  }
+
+  // - Rebases the map onto the root computed by detach_async. The writes made
+  //   since detach_async are kept, merged into one fragment above the root.
+  // - Returns false and leaves the map unchanged if the map no longer derives
+  //   from the snapshotted head, e.g. after it was cleared or assigned.
+  // - Traced as a detach, which leaves the map with the same entries.
+  bool complete_detach(detached_root&& r) {
+    if (r.root_ == nullptr) return false;
+    if (head_ != r.source_) {
+      auto* link = &head_->parent_;
+      while (*link != nullptr and *link != r.source_) link = &(*link)->parent_;
+      if (*link == nullptr) return false;
+    }
+    QUICK_LAZY_MAP_TRACE_HOOK(on_detach, this);
+    if (head_ == r.source_) {
+      head_ = std::move(r.root_);
+      return true;
+    }
+    merge_top(r.source_);
+    // Unless the map was emptied, which dropped the chain altogether.
+    if (head_->parent_ == r.source_) head_->parent_ = std::move(r.root_);
+    return true;
+  }
+
   bool contains(const K& k) const {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_find, this, k);
+    QUICK_LAZY_MAP_LOOKUP_TIMER(k);
     return contains_internal(k);
   }
 
@@ -86,6 +1431,48 @@ class lazy_map {
     return depth;
   }
 
+  // Statistics of one fragment of the chain, see visit_fragments.
+  struct fragment_info {
+    // Address of the fragment, the same for every map sharing it.
+    const void* id = nullptr;
+    const void* parent = nullptr;  // nullptr for the root.
+    size_t depth = 0;  // Number of ancestors.
+    size_t entries = 0;
+    size_t tombstones = 0;
+    // Entries hidden from this map by the fragments above.
+    size_t shadowed = 0;
+    // Approximate memory of the fragment and its tables, not counting what
+    // the keys and values themselves own.
+    size_t bytes = 0;
+    // Owners: maps whose head it is, and child fragments.
+    long use_count = 0;
+  };
+
+  // - Calls @f(const fragment_info&) for each fragment of the chain, from the
+  //   head to the root. For introspection and capacity planning, see
+  //   lazy_map_inspect.hpp.
+  // - Costs O(entries x depth), to find the shadowed entries.
+  template<typename F>
+  void visit_fragments(F&& f) const {
+    size_t depth = get_depth();
+    for (auto* link = &head_; *link != nullptr; link = &(*link)->parent_) {
+      const Fragment* p = link->get();
+      fragment_info info;
+      info.id = p;
+      info.parent = p->parent();
+      info.depth = depth--;
+      info.entries = p->key_values_.size();
+      info.tombstones = p->deleted_keys_.size();
+      for (const auto& kv : p->key_values_) {
+        if (is_shadowed(head_.get(), p, kv.first)) info.shadowed++;
+      }
+      info.bytes = sizeof(Fragment) + p->key_values_.heap_bytes()
+                     + p->deleted_keys_.heap_bytes();
+      info.use_count = link->use_count();
+      f(static_cast<const fragment_info&>(info));
+    }
+  }
+
   const V& at(const K& k) const {
     auto&& it = find(k);
     if (it.is_end()) {
@@ -107,18 +1494,169 @@ class lazy_map {
     return size() == 0;
   }
 
+  // Capacity control of the head fragment, which receives all the writes.
+  // The map is unchanged but a shared head is first replaced by a private
+  // one, same as on any write.
+  void reserve(size_t n) {
+    prepare_for_edit();
+    head_->key_values_.reserve(n);
+  }
+
+  void rehash(size_t n) {
+    prepare_for_edit();
+    head_->key_values_.rehash(n);
+  }
+
+  float load_factor() const {
+    return head_->key_values_.load_factor();
+  }
+
+  float max_load_factor() const {
+    return head_->key_values_.max_load_factor();
+  }
+
+  void max_load_factor(float ml) {
+    prepare_for_edit();
+    head_->key_values_.max_load_factor(ml);
+  }
+
+  // - Leveled compaction: merges the small fragments at the top of the chain
+  //   into one fragment private to this map, so that fragment sizes grow
+  //   geometrically toward the root. An ancestor is merged while its size is
+  //   below @ratio times the size of all the fragments above it.
+  // - The root, usually a large base shared with other maps, is never
+  //   merged. Hence this costs O(size of the merged deltas) unlike detach(),
+  //   and keeps get_depth() logarithmic under a stream of copies and writes.
+  // - Returns the number of ancestors merged into the head.
+  size_t compact(size_t ratio = 2) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_compact, this, ratio);
+    size_t merged = 0;
+    size_t above = weight(*head_);
+    auto* link = &head_->parent_;
+    for (; *link != nullptr and (*link)->parent_ != nullptr;
+         link = &(*link)->parent_) {
+      size_t w = weight(**link);
+      if (w >= ratio * above) break;
+      above += w;
+      merged++;
+    }
+    if (merged > 0) merge_top(*link);
+    return merged;
+  }
+
+  // - Partial detach: merges the top @k fragments of the chain, head
+  //   included, into one fragment private to this map. The fragments below
+  //   them, typically a large base shared with other maps, are kept as they
+  //   are instead of being copied as detach() does.
+  // - Returns the number of ancestors merged into the head.
+  size_t flatten_top(size_t k) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_flatten_top, this, k);
+    size_t merged = 0;
+    auto* link = &head_->parent_;
+    for (; *link != nullptr and merged + 1 < k; link = &(*link)->parent_) {
+      merged++;
+    }
+    if (merged > 0) merge_top(*link);
+    return merged;
+  }
+
+  // - Same as flatten_top, down to the first ancestor with at least
+  //   @size_threshold entries, which is kept. Detaches the map if there is no
+  //   such ancestor.
+  size_t flatten_until(size_t size_threshold) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_flatten_until, this, size_threshold);
+    size_t merged = 0;
+    auto* link = &head_->parent_;
+    for (; *link != nullptr and (*link)->key_values_.size() < size_threshold;
+         link = &(*link)->parent_) {
+      merged++;
+    }
+    if (merged > 0) merge_top(*link);
+    return merged;
+  }
+
+  // - Replays the edits this map made on top of @old_base onto @new_base: the
+  //   map becomes a copy of @new_base with those edits applied. Costs
+  //   O(size of the edits), e.g. to carry per-tenant overrides over to a
+  //   replaced global config.
+  // - @old_base must be an ancestor of this map, i.e. this map is a copy of
+  //   it followed by edits. Returns false and leaves the map unchanged
+  //   otherwise. An empty @old_base has nothing to inherit, every entry of
+  //   the map is then an edit.
+  bool rebase(const lazy_map& old_base, lazy_map new_base) {
+    std::shared_ptr<Fragment> base = old_base.head_;
+    auto* link = &head_;
+    while (*link != nullptr and *link != base) link = &(*link)->parent_;
+    if (*link == nullptr) {
+      if (not old_base.empty()) return false;
+      base = nullptr;
+    }
+    QUICK_LAZY_MAP_TRACE_HOOK(on_rebase, this, &old_base, &new_base);
+    // A private head over @base holding all the edits. Not through
+    // prepare_for_edit, which would drop the shared empty fragment.
+    if (not owned_alone(head_)) {
+      auto new_node = std::make_shared<Fragment>(std::move(head_));
+      head_ = std::move(new_node);
+    }
+    merge_top(base);
+    Fragment& delta = *head_;
+    if (weight(delta) == 0) {
+      head_ = std::move(new_base.head_);
+      return true;
+    }
+    const Fragment* target = new_base.head_.get();
+    size_t size = target->size_;
+    for (const auto& kv : delta.key_values_) {
+      if (not contains_internal(target, kv.first)) size++;
+    }
+    std::vector<K> stale;
+    for (const auto& k : delta.deleted_keys_) {
+      if (contains_internal(target, k)) {
+        size--;
+      } else {
+        stale.push_back(k);
+      }
+    }
+    for (const auto& k : stale) {
+      delta.deleted_keys_.erase(k);
+    }
+    delta.size_ = size;
+    delta.parent_ = std::move(new_base.head_);
+    return true;
+  }
+
+  // - Rebuilds the fragments owned by this map alone into a compact layout
+  //   for reading: exactly sized arrays in place of node based hash tables.
+  // - Meant for a map about to be shared and mostly read, e.g. a base map
+  //   right before it's copied. Fragments shared with other maps are left as
+  //   they are, since those maps may be reading them concurrently.
+  // - The next write to the head moves it back to a hash table.
+  void seal() {
+    for (auto* link = &head_; *link != nullptr; link = &(*link)->parent_) {
+      if (not owned_alone(*link)) break;
+      (*link)->key_values_.seal();
+      (*link)->deleted_keys_.seal();
+    }
+  }
+
   void insert_or_assign(const K& k, const V& v) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_insert_or_assign, this, k, v);
     prepare_for_edit();
-    head_->size_ += contains_internal(k) ? 0: 1;
-    head_->deleted_keys_.erase(k);
+    // Counted once the value is in, in case copying it throws.
+    size_t added = contains_internal(k) ? 0 : 1;
     put_key_value(head_->key_values_, k, v);
+    head_->deleted_keys_.erase(k);
+    head_->size_ += added;
   }
 
   void insert_or_assign(const K& k, V&& v) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_insert_or_assign, this, k, v);
     prepare_for_edit();
-    head_->size_ += contains_internal(k) ? 0: 1;
-    head_->deleted_keys_.erase(k);
+    // Counted once the value is in, in case copying it throws.
+    size_t added = contains_internal(k) ? 0 : 1;
     put_key_value(head_->key_values_, k, std::move(v));
+    head_->deleted_keys_.erase(k);
+    head_->size_ += added;
   }
 
   void insert_or_assign(const value_type& kv) {
@@ -140,6 +1678,7 @@ class lazy_map {
   }
 
   bool insert(const K& k, const V& v) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_insert, this, k, v);
     if (contains_internal(k)) return false;
     prepare_for_edit();
     head_->deleted_keys_.erase(k);
@@ -149,6 +1688,7 @@ class lazy_map {
   }
 
   bool insert(const K& k, V&& v) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_insert, this, k, v);
     if (contains_internal(k)) return false;
     prepare_for_edit();
     head_->deleted_keys_.erase(k);
@@ -167,22 +1707,73 @@ class lazy_map {
 
   template<typename... Args>
   bool emplace(const K& k, Args&&... args) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_insert, this, k);
     if (contains_internal(k)) return false;
     prepare_for_edit();
     head_->deleted_keys_.erase(k);
-    head_->key_values_.emplace(std::piecewise_construct,
-                           std::forward_as_tuple(k),
-                           std::tuple<Args&&...>(std::forward<Args>(args)...));
+    head_->key_values_.try_emplace(k, std::forward<Args>(args)...);
+    head_->size_++;
+    return true;
+  }
+
+  // - Removes @k from the map and returns its entry as a node handle, which
+  //   can be inserted into another lazy_map or std::unordered_map<K, V>.
+  // - The node is not reallocated if it sits in the hash table of a head
+  //   owned by this map alone. Otherwise the entry is moved to a new node,
+  //   or copied if its fragment is shared with other maps.
+  // - Returns an empty node handle if @k doesn't exist.
+  node_type extract(const K& k) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_erase, this, k);
+    auto&& iter = find_internal(k);
+    if (iter.is_end()) return node_type();
+    node_type nh;
+    if (owned_alone(head_) and iter.current_ == head_.get()) {
+      nh = head_->key_values_.extract(k);
+    } else {
+      std::unordered_map<K, V> spare;
+      if (owns_exclusively(iter.current_)) {
+        // Left moved-from in an ancestor, and hidden by a tombstone below.
+        spare.try_emplace(k, std::move(mutable_value(iter)));
+      } else {
+        spare.try_emplace(k, copy_value(iter->second));
+      }
+      nh = spare.extract(spare.begin());
+      prepare_for_edit();
+    }
+    if (contains_internal(k)) {
+      head_->deleted_keys_.insert(k);
+    }
+    head_->size_--;
+    return nh;
+  }
+
+  // - Inserts the entry of node handle @nh if its key doesn't exist yet.
+  //   The node itself moves into the head fragment when it is hashed.
+  // - Returns false, leaving @nh untouched, if the key exists or @nh is empty.
+  bool insert(node_type&& nh) {
+    if (nh.empty()) return false;
+    QUICK_LAZY_MAP_TRACE_HOOK(on_insert, this, nh.key(), nh.mapped());
+    if (contains_internal(nh.key())) return false;
+    prepare_for_edit();
+    head_->deleted_keys_.erase(nh.key());
+    head_->key_values_.insert(std::move(nh));
     head_->size_++;
     return true;
   }
 
   void clear() {
-    // No need to prepare_for_edit.
-    head_ = std::make_shared<Fragment>();
+    QUICK_LAZY_MAP_TRACE_HOOK(on_clear, this);
+    // No need to prepare_for_edit. A head owned by this map alone is emptied
+    // in place, keeping its tables' capacity for the next writes.
+    if (owned_alone(head_)) {
+      head_->clear();
+    } else {
+      head_ = empty_fragment();
+    }
   }
 
   bool erase(const K& k) {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_erase, this, k);
     if (not contains_internal(k)) return false;
     prepare_for_edit();
     head_->key_values_.erase(k);
@@ -194,7 +1785,7 @@ class lazy_map {
   }
 
   // - Move out the value of a key and return. Raise exception if the key
-  //   doesn't exists. If the value is shared by other objects, it will be
+  //   doesn't exists. If the value is shared with other maps, it will be
   //   copied.
   // - It is useful when we need to update the value efficiently.
   // - Equivalent of std::move(my_map.at(key)) in standard map.
@@ -213,18 +1804,59 @@ class lazy_map {
 
   // - Move the value at @iter from this map and return. After this operation,
   //   iter->second will be in moved-from state.
-  // - If the value is shared by other objects, it will be copied.
+  // - The value is moved if every fragment from the head down to the one
+  //   holding it is owned by this map alone, e.g. right after a detach. If
+  //   the value is shared with other maps, it will be copied.
   // - If you cannot afford to copy, use move_only method.
   // - Behavior is undefined if @iter is past the end.
   // - This is a non-standard map method.
   V move(const const_iter_impl& iter) {
-    if (head_.unique() and iter.current_ == head_.get()) {
-      return std::move(to_non_const_iter(head_->key_values_, iter.it_)->second);
+    if (owns_exclusively(iter.current_)) {
+      return std::move(mutable_value(iter));
     } else {
       return iter.it_->second;
     }
   }
 
+  // - Updates the value of @k in place: calls @f(V& value) on a value private
+  //   to this map. Raise exception if the key doesn't exists.
+  // - One lookup, instead of the move(k) and insert_or_assign(k, ...) pair.
+  //   The value is edited where it is if the head holds it and is owned by
+  //   this map alone. Otherwise it is moved (or copied, if shared with other
+  //   maps) into the head first.
+  // - This is a non-standard map method.
+  // - Traced as an insert_or_assign of the updated value.
+  template<typename F>
+  void update(const K& k, F&& f) {
+    auto&& iter = find_internal(k);
+    if (iter.is_end()) {
+      throw std::out_of_range(key_error);
+    }
+    bool exclusive = owns_exclusively(iter.current_);
+    if (exclusive and iter.current_ == head_.get()) {
+      V& v = mutable_value(iter);
+      f(v);
+      QUICK_LAZY_MAP_TRACE_HOOK(on_insert_or_assign, this, k, v);
+      return;
+    }
+    V v = exclusive ? std::move(mutable_value(iter))
+                    : copy_value(iter.it_->second);
+    prepare_for_edit();
+    // @k is not in the head, which would have shadowed @iter.
+    auto r = head_->key_values_.try_emplace(k, std::move(v));
+    f(r.first->second);
+    QUICK_LAZY_MAP_TRACE_HOOK(on_insert_or_assign, this, k, r.first->second);
+  }
+
+  // - Updates the value of @k2 in the nested map at @k1, e.g. for a
+  //   lazy_map<K1, lazy_map<K2, V2>>. Calls @f(V2&) on it.
+  // - Copies at most the outer entry, which is O(1) for a lazy_map, and then
+  //   the inner entry. One lookup per level.
+  template<typename K2, typename F>
+  void update_in(const K& k1, const K2& k2, F&& f) {
+    update(k1, [&](V& inner) { inner.update(k2, std::forward<F>(f)); });
+  }
+
   // Similar to move(k) method but the difference is:
   //  it return empty optional if the value is shared by other objects.
   std::optional<V> move_only(const K& k) {
@@ -238,17 +1870,57 @@ class lazy_map {
 
   // - Move the value at @iter from this map and return. After this operation,
   //   iter->second will be in moved-from state.
-  // - If the value is shared by other objects, empty optional will be returned.
+  // - If the value is shared with other maps, empty optional will be returned.
   // - If you cannot afford empty std::optional, use 'move' method above.
   // - Behavior is undefined if @iter is past the end.
   std::optional<V> move_only(const const_iter_impl& iter) {
-    if (head_.unique() and iter.current_ == head_.get()) {
-      return std::move(to_non_const_iter(head_->key_values_, iter.it_)->second);
+    if (owns_exclusively(iter.current_)) {
+      return std::move(mutable_value(iter));
     } else {
       return std::optional<V>();
     }
   }
 
+  // - Consumes the map: calls @f(const K& key, V&& value) once for every key
+  //   of the map, and leaves the map empty.
+  // - Values in fragments owned by this map alone are moved, values shared
+  //   with other maps are copied.
+  // - Usage: std::move(m).drain([&](const K& k, V&& v) { ... });
+  // - Traced as a clear.
+  // - This is a non-standard map method.
+  template<typename F>
+  void drain(F&& f) && {
+    if (not std::is_copy_constructible<V>::value and
+        not owns_exclusively(nullptr)) {
+      throw std::logic_error(non_copyable_error);
+    }
+    bool exclusive = true;
+    for (auto* link = &head_; *link != nullptr; link = &(*link)->parent_) {
+      Fragment* p = link->get();
+      exclusive = exclusive and owned_alone(*link);
+      for (auto& kv : p->key_values_) {
+        if (is_shadowed(head_.get(), p, kv.first)) continue;
+        if (exclusive) {
+          f(kv.first, std::move(kv.second));
+        } else {
+          f(kv.first, copy_value(kv.second));
+        }
+      }
+    }
+    clear();
+  }
+
+  // Consumes the map and returns its entries, see drain().
+  // - This is a non-standard map method.
+  std::vector<std::pair<K, V>> extract_all() && {
+    std::vector<std::pair<K, V>> output;
+    output.reserve(size());
+    std::move(*this).drain([&](const K& k, V&& v) {
+      output.emplace_back(k, std::move(v));
+    });
+    return output;
+  }
+
   const_iter_impl begin() const {
     return const_iter_impl(head_.get());
   }
@@ -258,6 +1930,14 @@ class lazy_map {
   }
 
   const_iterator find(const K& k) const {
+    QUICK_LAZY_MAP_TRACE_HOOK(on_find, this, k);
+    QUICK_LAZY_MAP_LOOKUP_TIMER(k);
+    return find_internal(k);
+  }
+
+ private:
+  // find(), without the hooks. For the edits that look the key up first.
+  const_iter_impl find_internal(const K& k) const {
     for (const Fragment* p = head_.get(); p != nullptr; p = p->parent()) {
       auto it = p->key_values_.find(k);
       if (it != p->key_values_.end()) {
@@ -270,7 +1950,6 @@ class lazy_map {
     return const_iter_impl(nullptr);
   }
 
- private:
   bool insert_internal(const K& k, const V& v) {
     if (contains_internal(k)) return false;
     head_->deleted_keys_.erase(k);
@@ -295,27 +1974,166 @@ class lazy_map {
     return contains_internal(head_.get(), k);
   }
 
+  // Depth below @node of the fragment a lookup of @k stops at: the one
+  // holding or erasing @k, else the root.
+  static size_t resolution_depth(const Fragment* node, const K& k) {
+    size_t depth = 0;
+    for (const Fragment* p = node; p->parent() != nullptr; p = p->parent()) {
+      if (contains_key(p->key_values_, k)
+           or contains_key(p->deleted_keys_, k)) {
+        break;
+      }
+      depth++;
+    }
+    return depth;
+  }
+
+  // Whether an entry of @k in fragment @f is hidden by a fragment above it,
+  // from @top down to @f (exclusive).
+  static bool is_shadowed(const Fragment* top, const Fragment* f, const K& k) {
+    for (auto c = top; c != f; c = c->parent()) {
+      if (contains_key(c->key_values_, k)
+           or contains_key(c->deleted_keys_, k)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   void prepare_for_edit() {
-    if (not head_.unique()) {
+    if (not owned_alone(head_)) {
+      // Nothing to inherit from the shared empty fragment: first write of a
+      // default constructed or cleared map. Other empty heads may hold
+      // tombstones and are kept, a rebase() needs to find them in the chain.
+      if (head_ == empty_fragment()) {
+        head_ = std::make_shared<Fragment>();
+        return;
+      }
+      QUICK_LAZY_MAP_TIMER(push);
       auto new_node = std::make_shared<Fragment>(std::move(head_));
       head_ = std::move(new_node);
     }
   }
 
+  // Immutable empty fragment shared by all the empty maps. Never destroyed,
+  // and never unique, hence never edited in place.
+  static const std::shared_ptr<Fragment>& empty_fragment() {
+    static const auto* empty =
+        new std::shared_ptr<Fragment>(std::make_shared<Fragment>());
+    return *empty;
+  }
+
+  // Whether this map is the only owner of every fragment from the head down to
+  // @target (to the root if @target is nullptr). The shared empty fragment
+  // has nothing to move out of, and counts as owned.
+  bool owns_exclusively(const Fragment* target) const {
+    for (auto* link = &head_; *link != nullptr; link = &(*link)->parent_) {
+      if (not owned_alone(*link) && *link != empty_fragment()) return false;
+      if (link->get() == target) break;
+    }
+    return true;
+  }
+
+  // Value at @iter, in a fragment owned by this map alone.
+  V& mutable_value(const const_iter_impl& iter) {
+    auto* f = const_cast<Fragment*>(iter.current_);
+    return to_non_const_iter(f->key_values_, iter.it_)->second;
+  }
+
+  // Precondition(head_.unique())
   bool detach_internal() {
     if (head_->parent_ == nullptr) return false;
-    for (const Fragment* p = head_->parent(); p != nullptr; p = p->parent()) {
+    if (not std::is_copy_constructible<V>::value and
+        not owns_exclusively(nullptr)) {
+      throw std::logic_error(non_copyable_error);
+    }
+    // The head ends up with every key, size it once instead of rehashing
+    // while merging.
+    head_->key_values_.reserve(head_->size_);
+    merge_into(*head_, nullptr);
+    return true;
+  }
+
+  // Merges the fragments above @base into a private head whose parent is
+  // @base, an ancestor of the head. A nullptr @base detaches the map.
+  void merge_top(std::shared_ptr<Fragment> base) {
+    if (base == nullptr) {
+      // Not through detach(), the caller's operation is traced already.
+      QUICK_LAZY_MAP_TIMER(detach);
+      prepare_for_edit();
+      detach_internal();
+      return;
+    }
+    if (not std::is_copy_constructible<V>::value) {
+      for (auto* link = &head_; *link != base; link = &(*link)->parent_) {
+        if (link->use_count() != 1) {
+          throw std::logic_error(non_copyable_error);
+        }
+      }
+    }
+    prepare_for_edit();
+    // A shared empty head was replaced by a fresh root, nothing to merge.
+    if (head_->parent_ == nullptr) return;
+    merge_into(*head_, std::move(base));
+  }
+
+  // Merges into @head, a fragment owned by the caller alone, its ancestors
+  // down to @base (exclusive), then makes @base its parent. @base is nullptr
+  // to merge the whole chain.
+  static void merge_into(Fragment& head, std::shared_ptr<Fragment> base) {
+    // An ancestor reachable only through @head is released at the end of
+    // the merge, hence its values are moved rather than copied.
+    bool exclusive = true;
+    for (auto* link = &head.parent_; *link != base; link = &(*link)->parent_) {
+      Fragment* p = link->get();
+      exclusive = exclusive and owned_alone(*link);
       for (auto& v : p->key_values_) {
-        if (not contains_key(head_->deleted_keys_, v.first)) {
-          head_->key_values_.emplace(v.first, v.second);
+        if (not contains_key(head.deleted_keys_, v.first)) {
+          if (exclusive) {
+            head.key_values_.try_emplace(v.first, std::move(v.second));
+          } else {
+            head.key_values_.try_emplace(v.first, copy_value(v.second));
+          }
+        }
+      }
+      if (base == nullptr) {
+        insert_all(head.deleted_keys_, p->deleted_keys_);
+      } else {
+        for (const auto& k : p->deleted_keys_) {
+          if (not contains_key(head.key_values_, k)) {
+            head.deleted_keys_.insert(k);
+          }
         }
       }
-      const auto& d = p->deleted_keys_;
-      head_->deleted_keys_.insert(d.begin(), d.end());
     }
-    head_->deleted_keys_.clear();
-    head_->parent_ = nullptr;
-    return true;
+    if (base == nullptr) {
+      head.deleted_keys_.clear();
+    } else {
+      // Keep only the tombstones of keys that @base still has.
+      std::vector<K> stale;
+      for (const auto& k : head.deleted_keys_) {
+        if (not contains_internal(base.get(), k)) stale.push_back(k);
+      }
+      for (const auto& k : stale) {
+        head.deleted_keys_.erase(k);
+      }
+    }
+    head.parent_ = std::move(base);
+  }
+
+  // Number of entries and tombstones in @f.
+  static size_t weight(const Fragment& f) {
+    return f.key_values_.size() + f.deleted_keys_.size();
+  }
+
+  // Copy of a value owned by a shared fragment. Callers check that maps of
+  // non-copyable values never get here.
+  static V copy_value(const V& v) {
+    if constexpr (std::is_copy_constructible<V>::value) {
+      return v;
+    } else {
+      throw std::logic_error(non_copyable_error);
+    }
   }
 
   struct Fragment {
@@ -325,18 +2143,25 @@ class lazy_map {
     explicit Fragment(std::initializer_list<value_type> values)
       : key_values_(values), size_(key_values_.size()) { }
     explicit Fragment(const std::unordered_map<K, V>& other_map)
-      : key_values_(other_map), size_(key_values_.size()) { }
+      : key_values_(other_map.begin(), other_map.end()),
+        size_(key_values_.size()) { }
     explicit Fragment(std::unordered_map<K, V>&& other_map)
       : key_values_(std::move(other_map)), size_(key_values_.size()) { }
     template<typename InputIt>
     Fragment(InputIt first, InputIt last)
       : key_values_(first, last), size_(key_values_.size()) { }
+    void clear() {
+      parent_ = nullptr;
+      key_values_.clear();
+      deleted_keys_.clear();
+      size_ = 0;
+    }
     // Returns const parent. UB if parent is nullptr.
     const Fragment* parent() const { return parent_.get(); };
     Fragment* mutable_parent() { return parent_.get(); };
     std::shared_ptr<Fragment> parent_;
-    std::unordered_map<K, V> key_values_;
-    std::unordered_set<K> deleted_keys_;
+    underlying_map key_values_;
+    underlying_set deleted_keys_;
     size_t size_ = 0;
   };
   // The implementation of this iterator relies on the C++ standard's sayings,
@@ -347,6 +2172,11 @@ class lazy_map {
   // of one unordered_map with another.
   class const_iter_impl {
    public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = typename lazy_map::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type*;
+    using reference = const value_type&;
     // Default constructed iterator is the end() iterator.
     const_iter_impl() = default;
     const_iter_impl(const Fragment* head,
@@ -378,7 +2208,7 @@ class lazy_map {
       }
       return *this;
     }
-    const_iter_impl& operator++(int) {
+    const_iter_impl operator++(int) {
       auto old = *this;
       ++(*this);
       return old;
@@ -425,13 +2255,7 @@ class lazy_map {
     }
     // Precondition(@current_ != nullptr)
     bool should_ignore_key(const K& k) const {
-      for (auto c = head_; c != current_; c = c->parent_.get()) {
-        if (contains_key(c->key_values_, k)
-             or contains_key(c->deleted_keys_, k)) {
-          return true;
-        }
-      }
-      return false;
+      return is_shadowed(head_, current_, k);
     }
     // Invariant(head_ != nullptr || current_ == nullptr)
     const Fragment* head_ = nullptr;
@@ -448,10 +2272,153 @@ class lazy_map {
   std::shared_ptr<Fragment> head_;
 };
 
+// Value wrapper with copy-on-write semantics. Copying a cow_wrapper only
+// bumps a reference count, and the wrapped value is copied on the first
+// mutation of a wrapper that shares it. With lazy_map<K, cow_wrapper<V>>,
+// copying entries between fragments (detach, move, insert of a looked up
+// value) never deep copies a V.
+// A moved-from cow_wrapper holds no value and must be assigned before use.
+template<typename T>
+class cow_wrapper {
+ public:
+  cow_wrapper() : value_(std::make_shared<T>()) { }
+  cow_wrapper(const T& v) : value_(std::make_shared<T>(v)) { }
+  cow_wrapper(T&& v) : value_(std::make_shared<T>(std::move(v))) { }
+  template<typename... Args>
+  explicit cow_wrapper(std::in_place_t, Args&&... args)
+    : value_(std::make_shared<T>(std::forward<Args>(args)...)) { }
+
+  const T& get() const { return *value_; }
+  const T& operator*() const { return *value_; }
+  const T* operator->() const { return value_.get(); }
+
+  // Returns a mutable reference to the value, copying it first if it is
+  // shared with other wrappers.
+  T& mutable_get() {
+    if (not owned_alone(value_)) {
+      value_ = std::make_shared<T>(*value_);
+    }
+    return *value_;
+  }
+
+  bool is_shared() const { return value_.use_count() > 1; }
+
+  bool operator==(const cow_wrapper& o) const {
+    return value_ == o.value_ || *value_ == *o.value_;
+  }
+  bool operator!=(const cow_wrapper& o) const {
+    return not (*this == o);
+  }
+
+ private:
+  std::shared_ptr<T> value_;
+};
+
+class interned_string;
+
+// Pool in which every distinct string is stored exactly once. A map keyed by
+// interned_string keeps an 8 byte handle per key instead of a copy of the
+// string, and compares keys by address. All keys of a map (and its copies)
+// must come from the same arena. Interned strings live as long as the arena.
+// Thread safe.
+class key_arena {
+ public:
+  key_arena() = default;
+  key_arena(const key_arena&) = delete;
+  key_arena& operator=(const key_arena&) = delete;
+
+  // Arena used by the string constructors of interned_string. It is never
+  // destroyed, so its strings outlive static maps too. Nothing is ever freed
+  // from it either.
+  static key_arena& global() {
+    static key_arena* arena = new key_arena();
+    return *arena;
+  }
+
+  interned_string intern(const std::string& s);
+
+  // Returns the handle of @s, or empty optional if @s was never interned in
+  // this arena. Unlike intern(), lookups of unknown keys don't grow the arena.
+  std::optional<interned_string> find(const std::string& s) const;
+
+  // Number of distinct strings in the arena.
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return strings_.size();
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  // Node based, hence the address of an element never changes.
+  std::unordered_set<std::string> strings_;
+};
+
+// Handle of a string interned in a key_arena. Copying, hashing and comparing
+// for equality touch the handle only, never the characters.
+class interned_string {
+ public:
+  // The empty string, same as interning "".
+  interned_string() : str_(&empty_string()) { }
+  // Interns @s in key_arena::global(), for good. Explicit, so that a lookup
+  // by an unknown string doesn't grow the arena behind the caller's back:
+  // look up with key_arena::find() instead.
+  explicit interned_string(const std::string& s)
+    : interned_string(key_arena::global().intern(s)) { }
+  explicit interned_string(const char* s) : interned_string(std::string(s)) { }
+
+  const std::string& str() const { return *str_; }
+  operator const std::string&() const { return *str_; }
+  const std::string* handle() const { return str_; }
+
+  bool operator==(const interned_string& o) const { return str_ == o.str_; }
+  bool operator!=(const interned_string& o) const { return str_ != o.str_; }
+  // Ordered by string content.
+  bool operator<(const interned_string& o) const { return *str_ < *o.str_; }
+
+ private:
+  explicit interned_string(const std::string* s) : str_(s) { }
+  // The empty string is shared by all arenas.
+  static const std::string& empty_string() {
+    static const std::string* empty = new std::string();
+    return *empty;
+  }
+  const std::string* str_;
+  friend class key_arena;
+};
+
+inline interned_string key_arena::intern(const std::string& s) {
+  if (s.empty()) return interned_string();
+  std::lock_guard<std::mutex> lock(mutex_);
+  return interned_string(&*strings_.insert(s).first);
+}
+
+inline std::optional<interned_string> key_arena::find(
+    const std::string& s) const {
+  if (s.empty()) return interned_string();
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = strings_.find(s);
+  if (it == strings_.end()) return std::nullopt;
+  return interned_string(&*it);
+}
+
 }  // namespace lazy_map_impl
 
 using lazy_map_impl::lazy_map;
+using lazy_map_impl::cow_wrapper;
+using lazy_map_impl::key_arena;
+using lazy_map_impl::interned_string;
 
 }  // namespace quick
 
+namespace std {
+
+template<>
+struct hash<quick::interned_string> {
+  size_t operator()(const quick::interned_string& s) const {
+    return hash<const string*>()(s.handle());
+  }
+};
+
+}  // namespace std
+
 #endif  // QUICK_LAZY_MAP_HPP_
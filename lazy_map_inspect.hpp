@@ -0,0 +1,200 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+// Introspection of the fragment DAG behind a set of lazy_maps: where the
+// memory goes, what is shared, and how long the chains are.
+
+#ifndef QUICK_LAZY_MAP_INSPECT_HPP_
+#define QUICK_LAZY_MAP_INSPECT_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "lazy_map.hpp"
+
+namespace quick {
+namespace lazy_map_impl {
+
+// Totals over the fragments reachable from the maps of a fragment_dag. Each
+// fragment is counted once, however many maps share it.
+struct fragment_dag_totals {
+  size_t maps = 0;
+  size_t fragments = 0;
+  size_t entries = 0;  // Stored entries.
+  size_t tombstones = 0;
+  size_t bytes = 0;
+  // Entries in fragments with more than one owner, i.e. stored once for
+  // several maps.
+  size_t shared_entries = 0;
+  // Sum of the sizes of the maps, i.e. entries a deep copy of each would
+  // store.
+  size_t live_entries = 0;
+  // Entries kept alive while hidden by a newer entry or a tombstone. Counted
+  // per fragment, for the map that hides the fewest of them.
+  size_t shadowed_entries = 0;
+  size_t max_depth = 0;
+};
+
+// - Fragment DAG of a set of maps, for capacity planning: add() the maps of
+//   interest, then export the DAG with to_json() or to_dot() (Graphviz), or
+//   look at totals().
+// - Fragments are identified by address, so the maps must stay alive and
+//   unchanged until the DAG is exported.
+template<typename K, typename V>
+class fragment_dag {
+ public:
+  using map_type = lazy_map<K, V>;
+  using fragment_info = typename map_type::fragment_info;
+
+  void add(const map_type& m, std::string name = "") {
+    map_node node{std::move(name), m.size(), m.get_depth(), 0};
+    bool is_head = true;
+    m.visit_fragments([&](const fragment_info& f) {
+      auto r = index_.try_emplace(f.id, fragments_.size());
+      if (r.second) {
+        fragments_.push_back(f);
+      } else {
+        auto& seen = fragments_[r.first->second];
+        seen.shadowed = std::min(seen.shadowed, f.shadowed);
+      }
+      if (is_head) node.head = r.first->second;
+      is_head = false;
+    });
+    maps_.push_back(std::move(node));
+  }
+
+  fragment_dag_totals totals() const {
+    fragment_dag_totals t;
+    t.maps = maps_.size();
+    t.fragments = fragments_.size();
+    for (const auto& f : fragments_) {
+      t.entries += f.entries;
+      t.tombstones += f.tombstones;
+      t.bytes += f.bytes;
+      t.shared_entries += (f.use_count > 1) ? f.entries : 0;
+      t.shadowed_entries += f.shadowed;
+      t.max_depth = std::max(t.max_depth, f.depth);
+    }
+    for (const auto& m : maps_) {
+      t.live_entries += m.size;
+    }
+    return t;
+  }
+
+  std::string to_json() const {
+    std::string out = "{\"maps\": [";
+    for (size_t i = 0; i < maps_.size(); i++) {
+      const auto& m = maps_[i];
+      out += (i > 0 ? ", " : "");
+      out += "{\"name\": " + quote(m.name) + ", \"head\": \"f"
+               + std::to_string(m.head) + "\", \"size\": "
+               + std::to_string(m.size) + ", \"depth\": "
+               + std::to_string(m.depth) + "}";
+    }
+    out += "], \"fragments\": [";
+    for (size_t i = 0; i < fragments_.size(); i++) {
+      const auto& f = fragments_[i];
+      out += (i > 0 ? ", " : "");
+      out += "{\"id\": \"f" + std::to_string(i) + "\", \"parent\": "
+               + (f.parent ? "\"" + parent_id(f) + "\"" : "null")
+               + ", \"depth\": " + std::to_string(f.depth)
+               + ", \"entries\": " + std::to_string(f.entries)
+               + ", \"tombstones\": " + std::to_string(f.tombstones)
+               + ", \"shadowed\": " + std::to_string(f.shadowed)
+               + ", \"bytes\": " + std::to_string(f.bytes)
+               + ", \"use_count\": " + std::to_string(f.use_count) + "}";
+    }
+    auto t = totals();
+    out += "], \"totals\": {\"maps\": " + std::to_string(t.maps)
+             + ", \"fragments\": " + std::to_string(t.fragments)
+             + ", \"entries\": " + std::to_string(t.entries)
+             + ", \"tombstones\": " + std::to_string(t.tombstones)
+             + ", \"bytes\": " + std::to_string(t.bytes)
+             + ", \"shared_entries\": " + std::to_string(t.shared_entries)
+             + ", \"live_entries\": " + std::to_string(t.live_entries)
+             + ", \"shadowed_entries\": " + std::to_string(t.shadowed_entries)
+             + ", \"max_depth\": " + std::to_string(t.max_depth) + "}}";
+    return out;
+  }
+
+  // Maps are boxes pointing to their heads, fragments point to their parents.
+  std::string to_dot() const {
+    std::string out = "digraph lazy_map {\n";
+    for (size_t i = 0; i < maps_.size(); i++) {
+      const auto& m = maps_[i];
+      out += "  m" + std::to_string(i) + " [shape=box, label=\""
+               + escape(m.name) + "\\nsize=" + std::to_string(m.size)
+               + " depth=" + std::to_string(m.depth) + "\"];\n";
+      out += "  m" + std::to_string(i) + " -> f" + std::to_string(m.head)
+               + ";\n";
+    }
+    for (size_t i = 0; i < fragments_.size(); i++) {
+      const auto& f = fragments_[i];
+      out += "  f" + std::to_string(i) + " [label=\"f" + std::to_string(i)
+               + "\\nentries=" + std::to_string(f.entries)
+               + " tombstones=" + std::to_string(f.tombstones)
+               + "\\nshadowed=" + std::to_string(f.shadowed)
+               + " bytes=" + std::to_string(f.bytes)
+               + "\\nuse_count=" + std::to_string(f.use_count) + "\"];\n";
+      if (f.parent) {
+        out += "  f" + std::to_string(i) + " -> " + parent_id(f) + ";\n";
+      }
+    }
+    out += "}\n";
+    return out;
+  }
+
+ private:
+  struct map_node {
+    std::string name;
+    size_t size;
+    size_t depth;
+    size_t head;  // Index in fragments_.
+  };
+
+  std::string parent_id(const fragment_info& f) const {
+    return "f" + std::to_string(index_.at(f.parent));
+  }
+
+  // Escapes @s for a double quoted string, in JSON as well as in DOT.
+  static std::string escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+      if (c == '"' or c == '\\') {
+        out += '\\';
+        out += c;
+      } else if (c == '\n') {
+        out += "\\n";
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        // Other control characters are invalid in JSON strings.
+        const char* hex = "0123456789abcdef";
+        out += "\\u00";
+        out += hex[(c >> 4) & 0xf];
+        out += hex[c & 0xf];
+      } else {
+        out += c;
+      }
+    }
+    return out;
+  }
+
+  static std::string quote(const std::string& s) {
+    return "\"" + escape(s) + "\"";
+  }
+
+  std::vector<map_node> maps_;
+  std::vector<fragment_info> fragments_;
+  std::unordered_map<const void*, size_t> index_;  // Into fragments_.
+};
+
+}  // namespace lazy_map_impl
+
+using lazy_map_impl::fragment_dag;
+using lazy_map_impl::fragment_dag_totals;
+
+}  // namespace quick
+
+#endif  // QUICK_LAZY_MAP_INSPECT_HPP_
@@ -0,0 +1,90 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+#include "lazy_map_inspect.hpp"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using quick::lazy_map;
+using quick::fragment_dag;
+
+TEST(LazyMapInspectTest, FragmentInfo) {
+  lazy_map<int, int> base;
+  for (int i = 0; i < 100; i++) {
+    base.insert(i, i);
+  }
+  auto m = base;
+  m.insert_or_assign(1, 10);
+  m.erase(2);
+  std::vector<lazy_map<int, int>::fragment_info> infos;
+  m.visit_fragments([&](const auto& f) { infos.push_back(f); });
+  ASSERT_EQ(2, infos.size());
+  EXPECT_EQ(1, infos[0].depth);
+  EXPECT_EQ(1, infos[0].entries);
+  EXPECT_EQ(1, infos[0].tombstones);
+  EXPECT_EQ(0, infos[0].shadowed);
+  EXPECT_EQ(1, infos[0].use_count);
+  EXPECT_EQ(infos[1].id, infos[0].parent);
+  EXPECT_EQ(nullptr, infos[1].parent);
+  EXPECT_EQ(0, infos[1].depth);
+  EXPECT_EQ(100, infos[1].entries);
+  EXPECT_EQ(2, infos[1].shadowed);
+  EXPECT_EQ(2, infos[1].use_count);
+  EXPECT_GT(infos[1].bytes, 100 * sizeof(int) * 2);
+}
+
+TEST(LazyMapInspectTest, FragmentDag) {
+  lazy_map<int, int> base;
+  for (int i = 0; i < 100; i++) {
+    base.insert(i, i);
+  }
+  auto m1 = base;
+  m1.insert_or_assign(1, 10);
+  auto m2 = base;
+  m2.insert_or_assign(1, 20);
+  m2.insert_or_assign(200, 0);
+  auto m3 = m2;
+  m3.erase(5);
+  fragment_dag<int, int> dag;
+  dag.add(m1, "m1");
+  dag.add(m3, "m\"3\"");
+  auto t = dag.totals();
+  EXPECT_EQ(2, t.maps);
+  EXPECT_EQ(4, t.fragments);
+  EXPECT_EQ(103, t.entries);
+  EXPECT_EQ(1, t.tombstones);
+  EXPECT_EQ(102, t.shared_entries);
+  EXPECT_EQ(100 + 100, t.live_entries);
+  // Both maps hide the base entry of key 1.
+  EXPECT_EQ(1, t.shadowed_entries);
+  EXPECT_EQ(2, t.max_depth);
+  dag.add(base, "base");
+  EXPECT_EQ(0, dag.totals().shadowed_entries);
+  std::string json = dag.to_json();
+  EXPECT_NE(std::string::npos, json.find("\"name\": \"m\\\"3\\\"\""));
+  EXPECT_NE(std::string::npos, json.find("\"parent\": null"));
+  EXPECT_NE(std::string::npos, json.find("\"entries\": 100"));
+  EXPECT_NE(std::string::npos, json.find("\"shared_entries\": 102"));
+  std::string dot = dag.to_dot();
+  EXPECT_EQ(0, dot.find("digraph lazy_map {"));
+  EXPECT_NE(std::string::npos, dot.find("m0 -> f0;"));
+  EXPECT_NE(std::string::npos, dot.find("f0 -> f1;"));
+  EXPECT_NE(std::string::npos, dot.find("m2 -> f1;"));
+  // Control characters in a name are escaped too.
+  fragment_dag<int, int> dag2;
+  dag2.add(m1, "a\tb\r\x01\n");
+  EXPECT_NE(std::string::npos,
+            dag2.to_json().find("\"name\": \"a\\u0009b\\u000d\\u0001\\n\""));
+  EXPECT_NE(std::string::npos,
+            dag2.to_dot().find("a\\u0009b\\u000d\\u0001\\n"));
+  for (char c : dag2.to_json() + dag2.to_dot()) {
+    EXPECT_TRUE(c == '\n' or static_cast<unsigned char>(c) >= 0x20);
+  }
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
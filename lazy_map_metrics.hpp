@@ -0,0 +1,241 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+// Opt-in latency histograms of the lazy_map operations whose cost depends on
+// the fragment chain: detach(), the fragment pushed by the first write after
+// a copy, and find() / contains() by the depth at which they resolve.
+//
+// Build with -DQUICK_LAZY_MAP_METRICS to compile the timers into lazy_map,
+// then read quick::lazy_map_metrics::registry::global(), e.g. serve its
+// to_prometheus() for scraping. Without the macro the timers compile to
+// nothing.
+
+#ifndef QUICK_LAZY_MAP_METRICS_HPP_
+#define QUICK_LAZY_MAP_METRICS_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+
+namespace quick {
+namespace lazy_map_metrics {
+
+// - Histogram of durations in nanoseconds, HDR style: 8 linear sub-buckets
+//   per power of 2, hence quantiles within 12.5% of the exact value, from
+//   1ns to 2^40ns (~18 minutes) in a fixed array. Durations beyond are
+//   counted in the last bucket, with the exact max() kept aside.
+// - record() is a few relaxed atomic increments, and may be called from any
+//   thread. Readers see a consistent histogram once the writers are done,
+//   and a close enough one meanwhile.
+class latency_histogram {
+ public:
+  static constexpr int kSubBucketBits = 3;
+  static constexpr int kMaxMagnitude = 40;
+  static constexpr size_t kNumBuckets =
+      size_t(kMaxMagnitude - kSubBucketBits + 2) << kSubBucketBits;
+
+  void record(uint64_t ns) {
+    ns = std::max<uint64_t>(ns, 1);
+    buckets_[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (ns > max and not max_.compare_exchange_weak(
+                            max, ns, std::memory_order_relaxed)) { }
+  }
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+  uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+  // Upper bound of the @q quantile (0 < q <= 1), 0 if empty.
+  uint64_t quantile(double q) const {
+    uint64_t total = count();
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+      seen += buckets_[i].load(std::memory_order_relaxed);
+      if (seen > 0 and seen >= q * total) {
+        // The last bucket is unbounded.
+        return (i + 1 == kNumBuckets) ? max() : std::min(upper_bound(i), max());
+      }
+    }
+    return max();
+  }
+
+  // Number of durations <= @ns, @ns being a power of 2.
+  uint64_t count_at_most(uint64_t ns) const {
+    uint64_t output = 0;
+    for (size_t i = 0; i < kNumBuckets and upper_bound(i) <= ns; i++) {
+      output += buckets_[i].load(std::memory_order_relaxed);
+    }
+    return output;
+  }
+
+  void reset() {
+    for (auto& b : buckets_) b.store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+  }
+
+ private:
+  // Bucket i holds the durations in (lower, upper_bound(i)]. Indexing by
+  // ns - 1 aligns the upper bounds with the powers of 2.
+  static size_t bucket_of(uint64_t ns) {
+    uint64_t v = ns - 1;
+    if (v < (1u << kSubBucketBits)) return v;
+    int magnitude = 63 - __builtin_clzll(v);
+    if (magnitude > kMaxMagnitude) return kNumBuckets - 1;
+    int shift = magnitude - kSubBucketBits;
+    return (size_t(shift + 1) << kSubBucketBits)
+             + ((v >> shift) & ((1u << kSubBucketBits) - 1));
+  }
+
+  static uint64_t upper_bound(size_t i) {
+    if (i < (1u << kSubBucketBits)) return i + 1;
+    int shift = int(i >> kSubBucketBits) - 1;
+    uint64_t sub = (i & ((1u << kSubBucketBits) - 1)) + (1u << kSubBucketBits);
+    return ((sub + 1) << shift);
+  }
+
+  std::atomic<uint64_t> buckets_[kNumBuckets] = {};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+// Process wide histograms, filled in by lazy_map.
+class registry {
+ public:
+  // Lookups resolving this deep or deeper share the last histogram.
+  static constexpr size_t kMaxDepth = 16;
+
+  static registry& global() {
+    static registry* r = new registry();
+    return *r;
+  }
+
+  latency_histogram detach;
+  // Fragments pushed on top of a shared head by the first write after a copy.
+  latency_histogram push;
+
+  // find() and contains() resolved at @depth, i.e. at the fragment @depth
+  // levels below the head, found or erased there, or absent from the chain.
+  latency_histogram& lookup(size_t depth) {
+    return lookups_[std::min(depth, kMaxDepth - 1)];
+  }
+  const latency_histogram& lookup(size_t depth) const {
+    return lookups_[std::min(depth, kMaxDepth - 1)];
+  }
+
+  void reset() {
+    detach.reset();
+    push.reset();
+    for (auto& h : lookups_) h.reset();
+  }
+
+  // - Prometheus text exposition of the histograms, in seconds, with one
+  //   bucket per power of 2 nanoseconds.
+  // - Lookups are labelled by depth, the last one as e.g. "15+". Depths
+  //   never seen are left out.
+  std::string to_prometheus() const {
+    std::string out;
+    export_histogram("lazy_map_detach_seconds",
+                     "Duration of lazy_map::detach().", {}, detach, &out);
+    export_histogram("lazy_map_push_seconds",
+                     "Duration of pushing a fragment on a shared head.", {},
+                     push, &out);
+    std::string name = "lazy_map_lookup_seconds";
+    out += "# HELP " + name + " Duration of lazy_map::find() and contains()"
+           " by the depth they resolve at.\n";
+    out += "# TYPE " + name + " histogram\n";
+    for (size_t d = 0; d < kMaxDepth; d++) {
+      if (lookups_[d].count() == 0) continue;
+      std::string label = "depth=\"" + std::to_string(d)
+                            + (d + 1 == kMaxDepth ? "+" : "") + "\"";
+      export_histogram(name, "", label, lookups_[d], &out);
+    }
+    return out;
+  }
+
+ private:
+  registry() = default;
+
+  static std::string seconds(uint64_t ns) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.9g", ns / 1e9);
+    return buffer;
+  }
+
+  // Appends @h to @out, with the HELP and TYPE lines unless @help is empty.
+  static void export_histogram(const std::string& name,
+                               const std::string& help,
+                               const std::string& label,
+                               const latency_histogram& h, std::string* out) {
+    if (not help.empty()) {
+      *out += "# HELP " + name + " " + help + "\n";
+      *out += "# TYPE " + name + " histogram\n";
+    }
+    std::string prefix = label.empty() ? "" : label + ",";
+    std::string labels = label.empty() ? "" : "{" + label + "}";
+    for (int m = 0; m <= latency_histogram::kMaxMagnitude; m++) {
+      *out += name + "_bucket{" + prefix + "le=\"" + seconds(uint64_t(1) << m)
+                + "\"} " + std::to_string(h.count_at_most(uint64_t(1) << m))
+                + "\n";
+    }
+    *out += name + "_bucket{" + prefix + "le=\"+Inf\"} "
+              + std::to_string(h.count()) + "\n";
+    *out += name + "_sum" + labels + " " + seconds(h.sum()) + "\n";
+    *out += name + "_count" + labels + " " + std::to_string(h.count()) + "\n";
+  }
+
+  latency_histogram lookups_[kMaxDepth];
+};
+
+inline uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+// Records its lifetime into a histogram.
+class scoped_timer {
+ public:
+  explicit scoped_timer(latency_histogram& h)
+    : histogram_(h), start_(std::chrono::steady_clock::now()) { }
+  ~scoped_timer() { histogram_.record(elapsed_ns(start_)); }
+  scoped_timer(const scoped_timer&) = delete;
+  scoped_timer& operator=(const scoped_timer&) = delete;
+
+ private:
+  latency_histogram& histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Records its lifetime as a lookup, at the depth returned by @depth_fn. The
+// depth is computed after the clock stops, so it doesn't add to the latency.
+template<typename F>
+class lookup_timer {
+ public:
+  explicit lookup_timer(F depth_fn)
+    : depth_fn_(std::move(depth_fn)),
+      start_(std::chrono::steady_clock::now()) { }
+  ~lookup_timer() {
+    uint64_t ns = elapsed_ns(start_);
+    registry::global().lookup(depth_fn_()).record(ns);
+  }
+  lookup_timer(const lookup_timer&) = delete;
+  lookup_timer& operator=(const lookup_timer&) = delete;
+
+ private:
+  F depth_fn_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace lazy_map_metrics
+}  // namespace quick
+
+#endif  // QUICK_LAZY_MAP_METRICS_HPP_
@@ -0,0 +1,96 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+#define QUICK_LAZY_MAP_METRICS
+#include "lazy_map.hpp"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using quick::lazy_map;
+using quick::lazy_map_metrics::latency_histogram;
+using quick::lazy_map_metrics::registry;
+
+TEST(LazyMapMetricsTest, Histogram) {
+  latency_histogram h;
+  EXPECT_EQ(0, h.quantile(0.5));
+  for (uint64_t ns = 1; ns <= 1000; ns++) {
+    h.record(ns);
+  }
+  h.record(0);  // Counted as 1ns.
+  h.record(uint64_t(1) << 50);  // Beyond the last bucket.
+  EXPECT_EQ(1002, h.count());
+  EXPECT_EQ(uint64_t(1) << 50, h.max());
+  EXPECT_EQ(1 + 500500 + (uint64_t(1) << 50), h.sum());
+  // Within 12.5% above the exact quantiles.
+  EXPECT_LE(500, h.quantile(0.5));
+  EXPECT_GE(500 * 1.125, h.quantile(0.5));
+  EXPECT_LE(990, h.quantile(0.99));
+  EXPECT_GE(990 * 1.125, h.quantile(0.99));
+  EXPECT_EQ(uint64_t(1) << 50, h.quantile(1));
+  // Exact at the powers of 2.
+  EXPECT_EQ(2, h.count_at_most(1));
+  EXPECT_EQ(9, h.count_at_most(8));
+  EXPECT_EQ(513, h.count_at_most(512));
+  EXPECT_EQ(1001, h.count_at_most(1024));
+  h.reset();
+  EXPECT_EQ(0, h.count());
+  EXPECT_EQ(0, h.count_at_most(1024));
+}
+
+TEST(LazyMapMetricsTest, LazyMapOperations) {
+  auto& metrics = registry::global();
+  metrics.reset();
+  lazy_map<int, int> m;
+  m.insert_or_assign(1, 1);
+  EXPECT_EQ(0, metrics.push.count());  // Nothing shared to push on.
+  std::vector<lazy_map<int, int>> versions;
+  for (int i = 2; i <= 20; i++) {
+    versions.push_back(m);
+    m.insert_or_assign(i, i);
+  }
+  EXPECT_EQ(19, metrics.push.count());
+  EXPECT_EQ(19, m.get_depth());
+  EXPECT_TRUE(m.contains(20));
+  EXPECT_TRUE(m.contains(18));
+  EXPECT_TRUE(m.find(18) != m.end());
+  EXPECT_FALSE(m.contains(100));  // Resolved at the root.
+  EXPECT_EQ(1, metrics.lookup(0).count());
+  EXPECT_EQ(2, metrics.lookup(2).count());
+  EXPECT_EQ(1, metrics.lookup(registry::kMaxDepth - 1).count());
+  m.detach();
+  EXPECT_EQ(1, metrics.detach.count());
+  EXPECT_LE(metrics.detach.quantile(1), metrics.detach.max());
+  EXPECT_EQ(19, metrics.push.count());
+}
+
+TEST(LazyMapMetricsTest, Prometheus) {
+  auto& metrics = registry::global();
+  metrics.reset();
+  lazy_map<int, int> m = {{1, 1}};
+  auto m2 = m;
+  m2.insert_or_assign(2, 2);
+  m2.contains(1);
+  m2.detach();
+  std::string text = metrics.to_prometheus();
+  EXPECT_NE(std::string::npos,
+            text.find("# TYPE lazy_map_detach_seconds histogram\n"));
+  EXPECT_NE(std::string::npos,
+            text.find("lazy_map_detach_seconds_bucket{le=\"+Inf\"} 1\n"));
+  EXPECT_NE(std::string::npos,
+            text.find("lazy_map_detach_seconds_bucket{le=\"1e-09\"} "));
+  EXPECT_NE(std::string::npos, text.find("lazy_map_push_seconds_count 1\n"));
+  EXPECT_NE(std::string::npos,
+            text.find("lazy_map_lookup_seconds_count{depth=\"1\"} 1\n"));
+  EXPECT_NE(std::string::npos, text.find(
+      "lazy_map_lookup_seconds_bucket{depth=\"1\",le=\"+Inf\"} 1\n"));
+  // Depths never seen are left out.
+  EXPECT_EQ(std::string::npos, text.find("depth=\"0\""));
+  EXPECT_EQ(1, metrics.lookup(1).count());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
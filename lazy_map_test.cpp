@@ -3,8 +3,12 @@
 
 #include "lazy_map.hpp"
 
+#include <functional>
+#include <random>
+#include <thread>
 #include <vector>
 #include <unordered_map>
+#include <set>
 #include <unordered_set>
 #include <utility>
 
@@ -42,6 +46,27 @@ struct CopyMoveCounter {
   Info* info_;
 };
 
+namespace quick {
+namespace lazy_map_impl {
+
+class lazy_map_test_internals {
+ public:
+  template<typename M>
+  static const void* head(const M& m) {
+    return m.head_.get();
+  }
+
+  template<typename M>
+  static bool head_is_flat(const M& m) {
+    return m.head_->key_values_.flat();
+  }
+};
+
+}  // namespace lazy_map_impl
+}  // namespace quick
+
+using quick::lazy_map_impl::lazy_map_test_internals;
+
 template<typename M>
 std::unordered_set<typename M::key_type> GetKeys(const M& m) {
   std::unordered_set<typename M::key_type> output;
@@ -259,6 +284,96 @@ TEST(LazyMapTest, MoveMethodPerf) {
   }
 }
 
+TEST(LazyMapTest, MoveFromExclusiveAncestor) {
+  quick::lazy_map<int, CopyMoveCounter> m;
+  CopyMoveCounter::Info info;
+  for (int i = 0; i < 10; i++) {
+    m.insert(i, CopyMoveCounter(&info));
+  }
+  {
+    auto m2 = m;
+    m.insert(10, CopyMoveCounter(&info));
+  }
+  // The parent of m's head is not shared anymore, m2 is out of scope.
+  EXPECT_EQ(1, m.get_depth());
+  info.reset();
+  {
+    auto v = m.move(3);
+    EXPECT_EQ(1, info.moves());
+    EXPECT_EQ(0, info.copies());
+    m.insert_or_assign(3, std::move(v));
+    EXPECT_EQ(0, info.copies());
+    EXPECT_TRUE(m.move_only(5).has_value());
+    auto nh = m.extract(4);
+    EXPECT_EQ(0, info.copies());
+    EXPECT_FALSE(m.contains(4));
+    EXPECT_EQ(10, m.size());
+    EXPECT_EQ(10, GetKeys(m).size());
+  }
+  {
+    // Shared again, the values are copied.
+    auto m2 = m;
+    info.reset();
+    EXPECT_FALSE(m.move_only(6).has_value());
+    (void)m.move(6);
+    EXPECT_EQ(1, info.copies());
+    auto nh = m.extract(7);
+    EXPECT_EQ(2, info.copies());
+    EXPECT_TRUE(m2.contains(7));
+  }
+  // A non-copyable value in an exclusive ancestor.
+  lazy_map<int, std::unique_ptr<int>> m3;
+  m3.insert(1, std::make_unique<int>(1));
+  {
+    auto m4 = m3;
+    m3.insert(2, nullptr);
+  }
+  auto v = m3.move_only(1);
+  ASSERT_TRUE(v.has_value());
+  EXPECT_EQ(1, **v);
+}
+
+TEST(LazyMapTest, Update) {
+  quick::lazy_map<int, CopyMoveCounter> m;
+  CopyMoveCounter::Info info, info2;
+  m.insert(1, CopyMoveCounter(&info));
+  m.insert(2, CopyMoveCounter(&info));
+  info.reset();
+  // Owned by this map alone: edited in place.
+  m.update(1, [&](CopyMoveCounter& v) { v.info_ = &info2; });
+  EXPECT_EQ(0, info.total());
+  EXPECT_EQ(&info2, m.at(1).info_);
+  {
+    // Shared: copied once into the head.
+    auto m2 = m;
+    m.update(2, [&](CopyMoveCounter& v) { v.info_ = &info2; });
+    EXPECT_EQ(1, info.copies());
+    EXPECT_EQ(&info, m2.at(2).info_);
+    EXPECT_EQ(&info2, m.at(2).info_);
+  }
+  info.reset();
+  info2.reset();
+  // An exclusive ancestor: moved into the head.
+  m.update(1, [&](CopyMoveCounter& v) { v.info_ = &info; });
+  EXPECT_EQ(0, info2.copies());
+  EXPECT_EQ(0, info.copies());
+  EXPECT_EQ(&info, m.at(1).info_);
+  EXPECT_EQ(2, m.size());
+  EXPECT_THROW(m.update(3, [](CopyMoveCounter&) {}), std::out_of_range);
+
+  lazy_map<std::string, lazy_map<std::string, int>> state;
+  state.insert("a", {{"x", 1}, {"y", 2}});
+  state.insert("b", {{"x", 3}});
+  auto state2 = state;
+  state2.update_in("a", "x", [](int& v) { v += 10; });
+  state2.update_in("a", "x", [](int& v) { v += 10; });
+  EXPECT_EQ(21, state2.at("a").at("x"));
+  EXPECT_EQ(2, state2.at("a").at("y"));
+  EXPECT_EQ(1, state.at("a").at("x"));
+  EXPECT_EQ(1, state2.at("a").get_depth());
+  EXPECT_THROW(state2.update_in("b", "y", [](int&) {}), std::out_of_range);
+}
+
 TEST(LazyMapTest, NonCopiableValueType) {
   using std::unique_ptr;
   using std::make_unique;
@@ -279,6 +394,843 @@ TEST(LazyMapTest, NonCopiableValueType) {
   EXPECT_FALSE(v2.has_value());
 }
 
+TEST(LazyMapTest, DenseIntegerKeys) {
+  lazy_map<uint32_t, int> m1;
+  for (uint32_t i = 0; i < 1000; i++) {
+    m1.insert(i, i * 10);
+  }
+  auto m2 = m1;
+  m2.erase(7);
+  m2.insert_or_assign(8, 1);
+  m2.insert(5000000, 2);
+  EXPECT_EQ(1000, m2.size());
+  EXPECT_FALSE(m2.contains(7));
+  EXPECT_EQ(1, m2.at(8));
+  EXPECT_EQ(2, m2.at(5000000));
+  EXPECT_EQ(80, m1.at(8));
+  EXPECT_TRUE(m1.contains(7));
+  EXPECT_EQ(1000, GetKeys(m2).size());
+  EXPECT_TRUE(m2.detach());
+  EXPECT_EQ(1000, GetKeys(m2).size());
+  EXPECT_EQ(90, m2.at(9));
+  EXPECT_FALSE(m2.contains(7));
+  lazy_map<uint32_t, vector<int>> m3 = {{3, {1}}, {90000, {2}}, {7, {3}}};
+  EXPECT_EQ((vector<int>{1}), m3.move(3));
+  EXPECT_EQ((vector<int>{2}), m3.at(90000));
+  EXPECT_EQ((vector<int>{3}), m3.at(7));
+}
+
+TEST(LazyMapTest, DenseMapLayouts) {
+  // Sparse keys start as a sorted run, dense keys grow into an array, and
+  // many keys far apart end up hashed. Contents must not depend on layout.
+  for (uint32_t stride : {1u, 37u, 100003u}) {
+    quick::lazy_map_impl::dense_map<std::unique_ptr<uint32_t>> m;
+    std::unordered_map<uint32_t, uint32_t> expected;
+    for (uint32_t i = 0; i < 300; i++) {
+      uint32_t k = (i * 7919 % 300) * stride;
+      m.try_emplace(k, std::make_unique<uint32_t>(i));
+      expected[k] = i;
+      if (i % 3 == 0) {
+        uint32_t victim = (i / 2 * 7919 % 300) * stride;
+        m.erase(victim);
+        expected.erase(victim);
+      }
+    }
+    EXPECT_EQ(expected.size(), m.size());
+    std::unordered_map<uint32_t, uint32_t> actual;
+    for (auto& kv : m) {
+      actual[kv.first] = *kv.second;
+    }
+    EXPECT_EQ(expected, actual);
+    for (auto& kv : expected) {
+      ASSERT_NE(m.end(), m.find(kv.first));
+      EXPECT_EQ(kv.second, *m.find(kv.first)->second);
+    }
+    m.clear();
+    EXPECT_EQ(m.begin(), m.end());
+  }
+}
+
+TEST(LazyMapTest, BitmapTombstones) {
+  lazy_map<int64_t, int> m1;
+  for (int64_t i = -500; i < 500; i++) {
+    m1.insert(i * 1000003, 1);
+  }
+  auto m2 = m1;
+  for (int64_t i = -500; i < 500; i += 2) {
+    m2.erase(i * 1000003);
+  }
+  m2.insert(7, 2);
+  auto m3 = m2;
+  m3.erase(-499 * 1000003);
+  EXPECT_EQ(1000, m1.size());
+  EXPECT_EQ(501, m2.size());
+  EXPECT_EQ(500, m3.size());
+  EXPECT_EQ(500, GetKeys(m3).size());
+  EXPECT_FALSE(m3.contains(-500 * 1000003));
+  EXPECT_FALSE(m3.contains(-499 * 1000003));
+  EXPECT_TRUE(m2.contains(-499 * 1000003));
+  EXPECT_EQ(2, m3.at(7));
+  EXPECT_TRUE(m3.detach());
+  EXPECT_EQ(500, GetKeys(m3).size());
+  EXPECT_EQ(1000, GetKeys(m1).size());
+}
+
+TEST(LazyMapTest, BitmapSet) {
+  quick::lazy_map_impl::bitmap_set<int> s1, s2;
+  for (int k : {-70, -1, 0, 5, 63, 64, 1000}) {
+    EXPECT_TRUE(s1.insert(k).second);
+  }
+  EXPECT_FALSE(s1.insert(63).second);
+  for (int k : {-1, 2, 64, 1 << 30}) {
+    s2.insert(k);
+  }
+  s1.insert(s2);
+  EXPECT_EQ(9, s1.size());
+  std::set<int> keys(s1.begin(), s1.end());
+  EXPECT_EQ((std::set<int>{-70, -1, 0, 2, 5, 63, 64, 1000, 1 << 30}), keys);
+  EXPECT_EQ(1, s1.erase(-70));
+  EXPECT_EQ(0, s1.erase(-70));
+  EXPECT_FALSE(s1.contains(-70));
+  EXPECT_TRUE(s1.contains(1 << 30));
+  EXPECT_EQ(8, s1.size());
+  // Random inserts and erases, checked against std::set.
+  quick::lazy_map_impl::bitmap_set<int64_t> s3;
+  std::set<int64_t> expected;
+  std::mt19937_64 rng(7);
+  for (int i = 0; i < 20000; i++) {
+    int64_t k = int64_t(rng() % 4096) * ((i % 3 == 0) ? 1 : 1000003);
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(expected.erase(k), s3.erase(k));
+    } else {
+      EXPECT_EQ(expected.insert(k).second, s3.insert(k).second);
+    }
+  }
+  EXPECT_EQ(expected.size(), s3.size());
+  EXPECT_EQ(expected, std::set<int64_t>(s3.begin(), s3.end()));
+  s3.seal();
+  for (int64_t k : expected) {
+    EXPECT_TRUE(s3.contains(k));
+  }
+}
+
+TEST(LazyMapTest, ScatteredTombstonesScale) {
+  std::mt19937_64 rng(1);
+  vector<int64_t> keys(200000);
+  for (auto& k : keys) k = int64_t(rng());
+  lazy_map<int64_t, int> m1;
+  for (int64_t k : keys) {
+    m1.insert(k, 1);
+  }
+  // Every tombstone lands in its own bitmap block, of 16 bytes in a table
+  // kept between a quarter and half full.
+  auto m2 = m1;
+  for (int64_t k : keys) {
+    EXPECT_TRUE(m2.erase(k));
+  }
+  size_t tombstones = 0, bytes = 0;
+  m2.visit_fragments([&](const auto& info) {
+    if (info.depth == 1) {
+      tombstones = info.tombstones;
+      bytes = info.bytes;
+    }
+  });
+  EXPECT_EQ(keys.size(), tombstones);
+  EXPECT_LE(bytes, 64 * keys.size());
+  EXPECT_TRUE(m2.empty());
+  EXPECT_TRUE(GetKeys(m2).empty());
+  EXPECT_EQ(keys.size(), m1.size());
+}
+
+TEST(LazyMapTest, SmallMap) {
+  // Entries stay inline up to the capacity and then move to a hash table.
+  quick::lazy_map_impl::small_map<std::string, vector<int>, 4> m;
+  for (int i = 0; i < 10; i++) {
+    EXPECT_TRUE(m.try_emplace(std::to_string(i), vector<int>{i}).second);
+    EXPECT_FALSE(m.try_emplace(std::to_string(i), vector<int>{}).second);
+    EXPECT_EQ(i + 1, m.size());
+    EXPECT_EQ(0, m.erase("x"));
+    if (i == 2) {
+      EXPECT_EQ(1, m.erase("1"));
+      EXPECT_EQ(m.end(), m.find("1"));
+      EXPECT_EQ((vector<int>{2}), m.find("2")->second);
+      EXPECT_TRUE(m.try_emplace("1", vector<int>{1}).second);
+    }
+  }
+  std::set<std::string> keys;
+  for (auto& kv : m) {
+    keys.insert(kv.first);
+    EXPECT_EQ((vector<int>{std::stoi(kv.first)}), kv.second);
+  }
+  EXPECT_EQ(10, keys.size());
+  m.clear();
+  EXPECT_TRUE(m.empty());
+  EXPECT_EQ(m.begin(), m.end());
+}
+
+TEST(LazyMapTest, EraseShiftsArrayEntries) {
+  // Inline entries are kept in insertion order, an erase moves the entries
+  // after it down. Iterators to them are invalidated.
+  lazy_map<std::string, int> m1 = {{"a", 1}};
+  m1.insert("b", 2);
+  m1.insert("c", 3);
+  ASSERT_EQ(0, m1.get_depth());
+  const void* a = &*m1.find("a");
+  const void* b = &*m1.find("b");
+  EXPECT_TRUE(m1.erase("a"));
+  EXPECT_EQ(a, &*m1.find("b"));
+  EXPECT_EQ(b, &*m1.find("c"));
+  // Same for the sorted run of a fragment with integer keys.
+  lazy_map<uint32_t, int> m2;
+  m2.insert(5, 1);
+  m2.insert(100000, 2);
+  m2.insert(200000, 3);
+  const void* k5 = &*m2.find(5);
+  EXPECT_TRUE(m2.erase(5));
+  EXPECT_EQ(k5, &*m2.find(100000));
+  EXPECT_EQ(2, m2.at(100000));
+  EXPECT_EQ(3, m2.at(200000));
+}
+
+TEST(LazyMapTest, SmallDeltas) {
+  struct Large {
+    char bytes[1024] = {};
+  };
+  using quick::lazy_map_impl::inline_capacity;
+  // Large values are never stored inline.
+  EXPECT_EQ(0, (inline_capacity<std::pair<const std::string, Large>>));
+  lazy_map<std::string, Large> m1;
+  m1.insert("a", Large());
+  auto m2 = m1;
+  m2.erase("a");
+  EXPECT_TRUE(m1.contains("a"));
+  EXPECT_FALSE(m2.contains("a"));
+  lazy_map<std::string, int> m3;
+  for (int i = 0; i < 100; i++) {
+    m3.insert(std::to_string(i), i);
+  }
+  vector<lazy_map<std::string, int>> copies;
+  for (int i = 0; i < 20; i++) {
+    copies.push_back(m3);
+    copies.back().insert_or_assign(std::to_string(i), -i);
+    copies.back().erase(std::to_string(i + 1));
+    copies.back().insert("x", i);
+  }
+  for (int i = 0; i < 20; i++) {
+    EXPECT_EQ(-i, copies[i].at(std::to_string(i)));
+    EXPECT_FALSE(copies[i].contains(std::to_string(i + 1)));
+    EXPECT_EQ(i, copies[i].at("x"));
+    EXPECT_EQ(100, copies[i].size());
+    EXPECT_EQ(100, GetKeys(copies[i]).size());
+  }
+  EXPECT_EQ(100, GetKeys(m3).size());
+}
+
+TEST(LazyMapTest, InternedKeys) {
+  using quick::interned_string;
+  quick::key_arena arena;
+  auto a1 = arena.intern("alpha");
+  auto a2 = arena.intern(std::string("alph") + "a");
+  EXPECT_EQ(a1, a2);
+  EXPECT_EQ(&a1.str(), &a2.str());
+  EXPECT_EQ(sizeof(void*), sizeof(interned_string));
+  EXPECT_FALSE(arena.find("beta").has_value());
+  EXPECT_EQ(1, arena.size());
+  EXPECT_EQ(interned_string(), arena.intern(""));
+  lazy_map<interned_string, int> m1;
+  m1.insert(a1, 1);
+  m1.insert(arena.intern("beta"), 2);
+  auto m2 = m1;
+  m2.erase(arena.intern("beta"));
+  m2.insert(arena.intern("gamma"), 3);
+  EXPECT_EQ(3, arena.size());
+  EXPECT_EQ(1, m2.at(*arena.find("alpha")));
+  EXPECT_TRUE(m1.contains(*arena.find("beta")));
+  EXPECT_FALSE(m2.contains(*arena.find("beta")));
+  m2.detach();
+  EXPECT_EQ(&a1.str(), &m2.find(a1)->first.str());
+  // String constructors intern into the global arena.
+  lazy_map<interned_string, int> m3 = {{interned_string("x"), 1},
+                                       {interned_string("y"), 2}};
+  EXPECT_EQ(2, m3.at(interned_string("y")));
+  EXPECT_EQ("x", m3.find(interned_string("x"))->first.str());
+  // Lookups through the global arena's find() don't intern.
+  auto& global = quick::key_arena::global();
+  size_t global_size = global.size();
+  for (int i = 0; i < 100; i++) {
+    auto k = global.find("missing" + std::to_string(i));
+    EXPECT_FALSE(k.has_value() && m3.contains(*k));
+  }
+  EXPECT_EQ(global_size, global.size());
+  EXPECT_FALSE((std::is_convertible_v<std::string, interned_string>));
+}
+
+TEST(LazyMapTest, CowWrapper) {
+  using quick::cow_wrapper;
+  CopyMoveCounter::Info info;
+  lazy_map<int, cow_wrapper<CopyMoveCounter>> m1;
+  m1.insert(1, CopyMoveCounter(&info));
+  m1.insert(2, CopyMoveCounter(&info));
+  auto m2 = m1;
+  m2.insert(3, CopyMoveCounter(&info));
+  m2.erase(1);
+  auto m3 = m2;
+  m3.insert_or_assign(4, m2.at(2));
+  info.reset();
+  EXPECT_TRUE(m3.detach());
+  auto v = m3.move(2);
+  m3.insert_or_assign(2, v);
+  EXPECT_EQ(0, info.copies());
+  EXPECT_TRUE(v.is_shared());
+  v.mutable_get();
+  EXPECT_EQ(1, info.copies());
+  EXPECT_FALSE(v.is_shared());
+  EXPECT_NE(&v.get(), &m1.at(2).get());
+  EXPECT_EQ(&m1.at(2).get(), &m3.at(4).get());
+  cow_wrapper<vector<int>> w1 = vector<int>{1, 2};
+  auto w2 = w1;
+  EXPECT_EQ(w1, w2);
+  w2.mutable_get().push_back(3);
+  EXPECT_NE(w1, w2);
+  EXPECT_EQ((vector<int>{1, 2}), *w1);
+}
+
+TEST(LazyMapTest, DetachMovesFromExclusiveAncestors) {
+  CopyMoveCounter::Info info;
+  lazy_map<int, CopyMoveCounter> m1;
+  m1.insert(1, CopyMoveCounter(&info));
+  m1.insert(2, CopyMoveCounter(&info));
+  {
+    auto m2 = m1;
+    m1.insert(3, CopyMoveCounter(&info));
+    auto m3 = m1;
+    m1.insert(4, CopyMoveCounter(&info));
+  }
+  // m2 and m3 are gone, every ancestor is owned by m1 alone.
+  info.reset();
+  EXPECT_TRUE(m1.detach());
+  EXPECT_EQ(0, info.copies());
+  EXPECT_EQ(4, GetKeys(m1).size());
+  auto m4 = m1;
+  m1.insert(5, CopyMoveCounter(&info));
+  auto m5 = m1;
+  m1.insert(6, CopyMoveCounter(&info));
+  m5 = {};
+  // The root is still shared with m4, its 4 values are copied. The fragment
+  // holding key 5 belongs to m1 alone and is moved.
+  info.reset();
+  EXPECT_TRUE(m1.detach());
+  EXPECT_EQ(4, info.copies());
+  EXPECT_EQ(6, GetKeys(m1).size());
+
+  lazy_map<int, std::unique_ptr<int>> m6;
+  m6.insert(1, std::make_unique<int>(1));
+  {
+    auto m7 = m6;
+    m6.insert(2, std::make_unique<int>(2));
+    EXPECT_THROW(m6.detach(), std::logic_error);
+    EXPECT_EQ(1, *m6.at(1));
+    EXPECT_EQ(1, *m7.at(1));
+  }
+  EXPECT_TRUE(m6.detach());
+  EXPECT_EQ(1, *m6.at(1));
+  EXPECT_EQ(2, *m6.at(2));
+}
+
+TEST(LazyMapTest, CapacityControl) {
+  lazy_map<std::string, int> m1;
+  m1.max_load_factor(0.5);
+  EXPECT_EQ(0.5, m1.max_load_factor());
+  m1.reserve(1000);
+  EXPECT_EQ(0, m1.load_factor());
+  for (int i = 0; i < 1000; i++) {
+    m1.insert(std::to_string(i), i);
+  }
+  EXPECT_LE(m1.load_factor(), 0.5);
+  auto m2 = m1;
+  // The map is unchanged, only the private head of m2 is sized.
+  m2.rehash(64);
+  EXPECT_EQ(1, m2.get_depth());
+  EXPECT_EQ(1000, m2.size());
+  m2.insert("x", 1);
+  EXPECT_TRUE(m2.detach());
+  EXPECT_LE(m2.load_factor(), m2.max_load_factor());
+  EXPECT_EQ(1001, GetKeys(m2).size());
+  lazy_map<uint32_t, int> m3;
+  m3.reserve(100);
+  EXPECT_EQ(0, m3.load_factor());
+  for (uint32_t i = 0; i < 100; i++) {
+    m3.insert(i, i);
+  }
+  EXPECT_EQ(1, m3.load_factor());
+  // The max load factor is kept until the map moves to the hash layout.
+  lazy_map<uint32_t, int> m4;
+  m4.max_load_factor(0.25);
+  EXPECT_EQ(0.25, m4.max_load_factor());
+  for (uint32_t i = 0; i < 1000; i++) {
+    m4.insert(i * 1000003, i);
+  }
+  EXPECT_EQ(0.25, m4.max_load_factor());
+  EXPECT_LE(m4.load_factor(), 0.25);
+  m4.seal();
+  EXPECT_EQ(0.25, m4.max_load_factor());
+}
+
+TEST(LazyMapTest, ClearReusesHead) {
+  lazy_map<std::string, int> m1;
+  m1.reserve(100);
+  for (int i = 0; i < 100; i++) {
+    m1.insert(std::to_string(i), i);
+  }
+  float load_factor = m1.load_factor();
+  const void* head = lazy_map_test_internals::head(m1);
+  m1.clear();
+  EXPECT_EQ(head, lazy_map_test_internals::head(m1));
+  EXPECT_EQ(0, m1.size());
+  EXPECT_TRUE(GetKeys(m1).empty());
+  for (int i = 0; i < 100; i++) {
+    m1.insert(std::to_string(i), i);
+  }
+  EXPECT_EQ(head, lazy_map_test_internals::head(m1));
+  EXPECT_EQ(load_factor, m1.load_factor());
+  // A head shared with another map is left alone.
+  auto m2 = m1;
+  m2.insert("x", 1);
+  auto m3 = m2;
+  m2.clear();
+  EXPECT_EQ(0, m2.size());
+  EXPECT_EQ(0, m2.get_depth());
+  EXPECT_EQ(lazy_map_test_internals::head(lazy_map<std::string, int>()),
+            lazy_map_test_internals::head(m2));
+  EXPECT_EQ(101, m3.size());
+  EXPECT_EQ(101, GetKeys(m3).size());
+  EXPECT_EQ(100, GetKeys(m1).size());
+}
+
+TEST(LazyMapTest, Drain) {
+  CopyMoveCounter::Info info;
+  lazy_map<int, CopyMoveCounter> m1;
+  m1.insert(1, CopyMoveCounter(&info));
+  m1.insert(2, CopyMoveCounter(&info));
+  auto m2 = m1;
+  m1.insert(3, CopyMoveCounter(&info));
+  m1.erase(1);
+  info.reset();
+  std::unordered_set<int> keys;
+  std::move(m1).drain([&](const int& k, CopyMoveCounter&& v) {
+    keys.insert(k);
+    CopyMoveCounter sink(std::move(v));
+  });
+  // Key 2 lives in the root shared with m2, key 3 in m1's own head.
+  EXPECT_EQ((std::unordered_set<int>{2, 3}), keys);
+  EXPECT_EQ(1, info.copies());
+  EXPECT_TRUE(m1.empty());
+  EXPECT_TRUE(GetKeys(m1).empty());
+  EXPECT_EQ(2, m2.size());
+  info.reset();
+  std::move(m2).drain([&](const int&, CopyMoveCounter&& v) {
+    CopyMoveCounter sink(std::move(v));
+  });
+  EXPECT_EQ(0, info.copies());
+
+  lazy_map<int, std::unique_ptr<int>> m3;
+  m3.insert(1, std::make_unique<int>(10));
+  m3.insert(2, std::make_unique<int>(20));
+  auto entries = std::move(m3).extract_all();
+  ASSERT_EQ(2, entries.size());
+  EXPECT_EQ(entries[0].first * 10, *entries[0].second);
+  EXPECT_EQ(entries[1].first * 10, *entries[1].second);
+  EXPECT_TRUE(m3.empty());
+  // A default constructed map holds the shared empty fragment.
+  lazy_map<int, std::unique_ptr<int>> m4;
+  EXPECT_TRUE(std::move(m4).extract_all().empty());
+  EXPECT_FALSE(m4.detach());
+}
+
+TEST(LazyMapTest, NodeHandles) {
+  using Map = lazy_map<std::string, vector<int>>;
+  std::unordered_map<std::string, vector<int>> legacy;
+  for (int i = 0; i < 20; i++) {
+    legacy[std::to_string(i)] = {i};
+  }
+  const vector<int>* address = &legacy.at("3");
+  // The lazy_map takes over the hash table of the legacy map.
+  Map m1(std::move(legacy));
+  EXPECT_EQ(20, m1.size());
+  EXPECT_EQ(address, &m1.at("3"));
+  Map m2;
+  for (int i = 20; i < 40; i++) {
+    m2.insert(std::to_string(i), {i});
+  }
+  // Nodes move between uniquely owned heads without reallocation.
+  auto nh = m1.extract("3");
+  ASSERT_FALSE(nh.empty());
+  EXPECT_EQ(&nh.mapped(), address);
+  EXPECT_TRUE(m2.insert(std::move(nh)));
+  EXPECT_TRUE(nh.empty());
+  EXPECT_EQ(address, &m2.at("3"));
+  EXPECT_FALSE(m1.contains("3"));
+  EXPECT_EQ(19, m1.size());
+  EXPECT_EQ(21, m2.size());
+  EXPECT_TRUE(m1.extract("3").empty());
+  // The key is present already, the node handle is left untouched.
+  auto nh2 = m1.extract("4");
+  nh2.key() = "5";
+  EXPECT_FALSE(m1.insert(std::move(nh2)));
+  EXPECT_EQ((vector<int>{4}), nh2.mapped());
+  // Entries of a shared fragment are copied into a new node, and the map
+  // records a tombstone.
+  auto m3 = m2;
+  auto nh3 = m3.extract("25");
+  EXPECT_EQ((vector<int>{25}), nh3.mapped());
+  EXPECT_FALSE(m3.contains("25"));
+  EXPECT_TRUE(m2.contains("25"));
+  EXPECT_EQ(20, GetKeys(m3).size());
+  std::unordered_map<std::string, vector<int>> sink;
+  sink.insert(std::move(nh3));
+  EXPECT_EQ((vector<int>{25}), sink.at("25"));
+}
+
+TEST(LazyMapTest, SharedEmptyRoot) {
+  // Empty maps share one immutable fragment.
+  lazy_map<int, int> m1, m2;
+  EXPECT_EQ(lazy_map_test_internals::head(m1),
+            lazy_map_test_internals::head(m2));
+  EXPECT_TRUE(m1.empty());
+  EXPECT_FALSE(m1.contains(1));
+  EXPECT_EQ(m1.begin(), m1.end());
+  m1.insert(1, 10);
+  EXPECT_NE(lazy_map_test_internals::head(m1),
+            lazy_map_test_internals::head(m2));
+  EXPECT_EQ(0, m1.get_depth());
+  EXPECT_TRUE(m2.empty());
+  // Moved-from maps are empty and usable.
+  auto m3 = std::move(m1);
+  EXPECT_EQ(10, m3.at(1));
+  EXPECT_TRUE(m1.empty());
+  EXPECT_EQ(m1.begin(), m1.end());
+  m1.insert(2, 20);
+  EXPECT_EQ(1, m1.size());
+  m2 = std::move(m1);
+  EXPECT_EQ(20, m2.at(2));
+  EXPECT_FALSE(m1.contains(2));
+  EXPECT_FALSE(m1.detach());
+  EXPECT_TRUE(m1.empty());
+}
+
+TEST(LazyMapTest, Seal) {
+  lazy_map<std::string, int> m1;
+  for (int i = 0; i < 1000; i++) {
+    m1.insert(std::to_string(i), i);
+  }
+  m1.seal();
+  // Sealed flat table: entries in one array, index at most half full.
+  EXPECT_TRUE(lazy_map_test_internals::head_is_flat(m1));
+  EXPECT_LE(m1.load_factor(), 0.5);
+  EXPECT_EQ(1000, m1.size());
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(i, m1.at(std::to_string(i)));
+  }
+  EXPECT_FALSE(m1.contains("x"));
+  EXPECT_EQ(1000, GetKeys(m1).size());
+  {
+    // Copies read the sealed fragment, writes go to their own heads.
+    auto m2 = m1;
+    m2.insert("x", 1);
+    m2.erase("5");
+    m2.seal();
+    EXPECT_EQ(1, m2.get_depth());
+    EXPECT_EQ(1000, m2.size());
+    EXPECT_FALSE(m2.contains("5"));
+    EXPECT_EQ(1, m2.at("x"));
+    EXPECT_EQ(8, m2.at("8"));
+    EXPECT_TRUE(lazy_map_test_internals::head_is_flat(m1));
+  }
+  // Writes to a sealed head owned by m1 alone, done in place.
+  const void* head = lazy_map_test_internals::head(m1);
+  m1.erase("7");
+  EXPECT_FALSE(lazy_map_test_internals::head_is_flat(m1));
+  m1.erase("8");
+  m1.insert("x", 2);
+  EXPECT_EQ(head, lazy_map_test_internals::head(m1));
+  EXPECT_EQ(0, m1.get_depth());
+  EXPECT_FALSE(m1.contains("7"));
+  EXPECT_FALSE(m1.contains("8"));
+  EXPECT_EQ(9, m1.at("9"));
+  EXPECT_EQ(2, m1.at("x"));
+  EXPECT_EQ(999, m1.size());
+  EXPECT_EQ(999, GetKeys(m1).size());
+  // Hash layout of integer keys goes back to a dense array.
+  lazy_map<uint32_t, int> m3;
+  for (uint32_t i = 0; i < 100; i++) {
+    m3.insert(i, i);
+  }
+  m3.insert(1000000, 0);
+  m3.erase(1000000);
+  m3.seal();
+  EXPECT_EQ(1, m3.load_factor());
+  EXPECT_EQ(100, GetKeys(m3).size());
+  EXPECT_EQ(99, m3.at(99));
+  // A few entries go back inline.
+  lazy_map<int, int> m4;
+  for (int i = 0; i < 100; i++) {
+    m4.insert(i, i);
+  }
+  for (int i = 3; i < 100; i++) {
+    m4.erase(i);
+  }
+  m4.seal();
+  EXPECT_EQ(3.0f / 8, m4.load_factor());
+  EXPECT_EQ((std::unordered_set<int>{0, 1, 2}), GetKeys(m4));
+  // Extracting from a sealed head moves it back to a hash table too, which
+  // the following erases reuse.
+  lazy_map<std::string, int> m5;
+  for (int i = 0; i < 1000; i++) {
+    m5.insert(std::to_string(i), i);
+  }
+  m5.seal();
+  auto nh = m5.extract("0");
+  EXPECT_EQ(0, nh.mapped());
+  EXPECT_FALSE(lazy_map_test_internals::head_is_flat(m5));
+  for (int i = 1; i < 1000; i++) {
+    EXPECT_EQ(i, m5.at(std::to_string(i)));
+    EXPECT_TRUE(m5.erase(std::to_string(i)));
+    EXPECT_FALSE(m5.contains(std::to_string(i)));
+  }
+  EXPECT_TRUE(m5.empty());
+  EXPECT_TRUE(GetKeys(m5).empty());
+}
+
+TEST(LazyMapTest, Compaction) {
+  lazy_map<int, int> base;
+  for (int i = 0; i < 1000; i++) {
+    base.insert(i, i);
+  }
+  auto m = base;
+  std::unordered_map<int, int> expected(base.begin(), base.end());
+  vector<lazy_map<int, int>> snapshots;
+  size_t max_depth = 0;
+  for (int i = 0; i < 256; i++) {
+    snapshots.push_back(m);
+    m.insert_or_assign(i, -i);
+    expected[i] = -i;
+    if (i % 3 == 0) {
+      m.erase(500 + i);
+      expected.erase(500 + i);
+    }
+    m.compact();
+    max_depth = std::max(max_depth, m.get_depth());
+  }
+  EXPECT_LE(max_depth, 9);
+  EXPECT_EQ(expected.size(), m.size());
+  EXPECT_EQ(expected, (std::unordered_map<int, int>(m.begin(), m.end())));
+  // Copies are unchanged.
+  EXPECT_EQ(1000, snapshots[0].size());
+  EXPECT_EQ(0, snapshots[1].at(0));
+  EXPECT_EQ(-1, snapshots[2].at(1));
+  EXPECT_EQ(2, snapshots[2].at(2));
+  EXPECT_TRUE(snapshots[0].contains(500));
+  EXPECT_FALSE(snapshots[1].contains(500));
+  EXPECT_TRUE(snapshots[3].contains(503));
+  EXPECT_FALSE(snapshots[4].contains(503));
+  // The base is never merged.
+  EXPECT_EQ(1000, base.size());
+  m.insert_or_assign(0, 7);
+  EXPECT_EQ(0, base.at(0));
+  EXPECT_EQ(7, m.at(0));
+  // A big enough head leaves the chain alone.
+  auto m2 = base;
+  for (int i = 0; i < 10; i++) {
+    m2.insert_or_assign(i, 0);
+  }
+  auto m3 = m2;
+  m3.erase(5);
+  EXPECT_EQ(0, m3.compact());
+  EXPECT_EQ(2, m3.get_depth());
+}
+
+TEST(LazyMapTest, PartialDetach) {
+  lazy_map<int, int> base;
+  for (int i = 0; i < 1000; i++) {
+    base.insert(i, i);
+  }
+  auto m = base;
+  vector<lazy_map<int, int>> snapshots;
+  for (int i = 0; i < 6; i++) {
+    snapshots.push_back(m);
+    m.insert_or_assign(i, -i);
+    m.erase(100 + i);
+  }
+  EXPECT_EQ(6, m.get_depth());
+  EXPECT_EQ(0, m.flatten_top(1));
+  EXPECT_EQ(2, m.flatten_top(3));
+  EXPECT_EQ(4, m.get_depth());
+  EXPECT_EQ(3, m.flatten_until(500));
+  EXPECT_EQ(1, m.get_depth());
+  EXPECT_EQ(994, m.size());
+  EXPECT_EQ(-5, m.at(5));
+  EXPECT_FALSE(m.contains(105));
+  EXPECT_EQ(106, m.at(106));
+  EXPECT_EQ(994, GetKeys(m).size());
+  EXPECT_EQ(0, m.flatten_until(500));
+  // The base is kept, and so are the copies.
+  EXPECT_EQ(1000, base.size());
+  EXPECT_EQ(5, base.at(5));
+  EXPECT_EQ(997, snapshots[3].size());
+  EXPECT_EQ(-2, snapshots[3].at(2));
+  // No ancestor big enough, or more levels than the chain has: detach.
+  auto m2 = snapshots[5];
+  EXPECT_EQ(5, m2.flatten_until(5000));
+  EXPECT_TRUE(m2.is_detached());
+  auto m3 = snapshots[5];
+  EXPECT_EQ(5, m3.flatten_top(100));
+  EXPECT_TRUE(m3.is_detached());
+  EXPECT_EQ(GetKeys(m2), GetKeys(m3));
+  EXPECT_EQ(995, m3.size());
+}
+
+TEST(LazyMapTest, DetachAsync) {
+  vector<std::function<void()>> tasks;
+  auto executor = [&](std::function<void()> task) { tasks.push_back(task); };
+  lazy_map<int, int> base;
+  for (int i = 0; i < 1000; i++) {
+    base.insert(i, i);
+  }
+  auto m = base;
+  m.insert_or_assign(1, -1);
+  m.erase(2);
+  auto m2 = m;
+  auto result = m.detach_async(executor);
+  // The map is served while the task waits, and keeps its new writes.
+  m.insert_or_assign(3, -3);
+  m.erase(4);
+  m.insert_or_assign(2, -2);
+  EXPECT_EQ(-1, m.at(1));
+  ASSERT_EQ(1, tasks.size());
+  std::thread(tasks[0]).join();
+  EXPECT_TRUE(m.complete_detach(result.get()));
+  EXPECT_EQ(1, m.get_depth());
+  EXPECT_EQ(999, m.size());
+  EXPECT_EQ(-1, m.at(1));
+  EXPECT_EQ(-2, m.at(2));
+  EXPECT_EQ(-3, m.at(3));
+  EXPECT_FALSE(m.contains(4));
+  EXPECT_EQ(999, GetKeys(m).size());
+  m.detach();
+  EXPECT_EQ(999, GetKeys(m).size());
+  // Copies are unchanged.
+  EXPECT_EQ(999, m2.size());
+  EXPECT_FALSE(m2.contains(2));
+  EXPECT_EQ(1000, base.size());
+  // No writes in between, the root replaces the head.
+  tasks.clear();
+  result = m2.detach_async(executor);
+  tasks[0]();
+  EXPECT_TRUE(m2.complete_detach(result.get()));
+  EXPECT_TRUE(m2.is_detached());
+  EXPECT_EQ(999, GetKeys(m2).size());
+  // A map that was reassigned meanwhile is left alone.
+  tasks.clear();
+  auto m3 = base;
+  m3.erase(0);
+  result = m3.detach_async(executor);
+  m3 = base;
+  tasks[0]();
+  EXPECT_FALSE(m3.complete_detach(result.get()));
+  EXPECT_EQ(1000, m3.size());
+  // Writes on a real background thread.
+  auto m4 = m;
+  std::thread worker;
+  result = m4.detach_async([&](std::function<void()> task) {
+    worker = std::thread(task);
+  });
+  for (int i = 0; i < 100; i++) {
+    m4.insert_or_assign(i, i * 2);
+  }
+  worker.join();
+  EXPECT_TRUE(m4.complete_detach(result.get()));
+  EXPECT_EQ(1, m4.get_depth());
+  EXPECT_EQ(1000, m4.size());
+  EXPECT_EQ(198, m4.at(99));
+  EXPECT_EQ(500, m4.at(500));
+}
+
+TEST(LazyMapTest, Rebase) {
+  lazy_map<std::string, int> global = {{"a", 1}, {"b", 2}, {"c", 3}};
+  auto tenant = global;
+  tenant.insert_or_assign("a", 10);
+  tenant.insert_or_assign("x", 20);
+  tenant.erase("b");
+  tenant.erase("c");
+  auto tenant_copy = tenant;
+  tenant.insert_or_assign("c", 30);
+  // The global config is replaced.
+  auto new_global = global;
+  new_global.insert_or_assign("a", 100);
+  new_global.insert_or_assign("d", 4);
+  new_global.erase("b");
+  new_global.erase("c");
+  EXPECT_TRUE(tenant.rebase(global, new_global));
+  EXPECT_EQ(new_global.get_depth() + 1, tenant.get_depth());
+  EXPECT_EQ(4, tenant.size());
+  EXPECT_EQ(10, tenant.at("a"));
+  EXPECT_EQ(30, tenant.at("c"));
+  EXPECT_EQ(4, tenant.at("d"));
+  EXPECT_EQ(20, tenant.at("x"));
+  EXPECT_EQ((std::unordered_set<std::string>{"a", "c", "d", "x"}),
+            GetKeys(tenant));
+  tenant.detach();
+  EXPECT_EQ(4, GetKeys(tenant).size());
+  // Tombstones are kept for the keys the new base has.
+  auto new_global2 = new_global;
+  new_global2.insert_or_assign("b", 5);
+  EXPECT_TRUE(tenant_copy.rebase(global, new_global2));
+  EXPECT_EQ(3, tenant_copy.size());
+  EXPECT_FALSE(tenant_copy.contains("b"));
+  EXPECT_EQ((std::unordered_set<std::string>{"a", "d", "x"}),
+            GetKeys(tenant_copy));
+  // Base maps are unchanged.
+  EXPECT_EQ(3, global.size());
+  EXPECT_EQ(2, new_global.size());
+  EXPECT_EQ(100, new_global.at("a"));
+  // No edits, the map becomes a copy of the new base.
+  auto m = global;
+  EXPECT_TRUE(m.rebase(global, new_global));
+  EXPECT_EQ(GetKeys(new_global), GetKeys(m));
+  // Not derived from @old_base.
+  EXPECT_FALSE(new_global.rebase(tenant, global));
+  EXPECT_EQ(2, new_global.size());
+  // All keys erased, then rebased.
+  auto m2 = global;
+  m2.erase("a");
+  m2.erase("b");
+  m2.erase("c");
+  auto m3 = m2;
+  EXPECT_TRUE(m2.rebase(global, new_global2));
+  EXPECT_EQ((std::unordered_set<std::string>{"d"}), GetKeys(m2));
+  EXPECT_EQ(1, m2.size());
+  // The global config starts out empty.
+  lazy_map<int, int> g, other = {{1, 1}, {2, 2}};
+  auto t = g;
+  t.insert_or_assign(1, 10);
+  EXPECT_TRUE(t.rebase(g, other));
+  EXPECT_EQ(10, t.at(1));
+  EXPECT_EQ(2, t.at(2));
+  EXPECT_EQ(2, t.size());
+  EXPECT_EQ((std::unordered_set<int>{1, 2}), GetKeys(t));
+  // The delta is empty at some point.
+  g = {{1, 1}, {3, 3}};
+  t = g;
+  t.erase(1);
+  t.erase(3);
+  auto s = t;
+  t.insert_or_assign(5, 5);
+  EXPECT_TRUE(t.rebase(g, other));
+  EXPECT_EQ((std::unordered_set<int>{2, 5}), GetKeys(t));
+  EXPECT_EQ(2, t.size());
+  EXPECT_TRUE(s.empty());
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
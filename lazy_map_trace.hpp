@@ -0,0 +1,310 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+// Opt-in recording of lazy_map operations into a compact binary trace, for
+// replaying production workloads offline (see benchmark/lazy_map_replay.cpp).
+//
+// Build with -DQUICK_LAZY_MAP_TRACE to compile the hooks into lazy_map, then
+// call quick::lazy_map_trace::recorder::global().start(path). Without the
+// macro the hooks compile to nothing.
+//
+// Edits without an op of their own are recorded as the op leaving the map
+// with the same entries: extract() as an erase, insert(node_type&&) as an
+// insert, update() and update_in() as an insert_or_assign of the updated
+// value, drain() and extract_all() as a clear, and complete_detach() as a
+// detach. detach_async(), seal(), reserve(), rehash() and max_load_factor()
+// change no entry and are not traced.
+
+#ifndef QUICK_LAZY_MAP_TRACE_HPP_
+#define QUICK_LAZY_MAP_TRACE_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace quick {
+namespace lazy_map_trace {
+
+enum class op : uint8_t {
+  copy = 1,  // arg: id of the source map.
+  move,      // arg: id of the source map.
+  insert_or_assign,  // arg: key, value: value.
+  insert,            // arg: key, value: value.
+  erase,             // arg: key.
+  find,              // arg: key. Also contains() and at().
+  detach,
+  clear,
+  destroy,
+  rebase,  // arg: id of the old base | id of the new base << 32.
+  compact,        // arg: ratio.
+  flatten_top,    // arg: k.
+  flatten_until,  // arg: size threshold.
+};
+
+// One operation. Maps are numbered in order of first appearance, and a
+// number is reused by no other map. Keys and values are recorded as is if
+// integral, otherwise as their std::hash.
+// Encoded as: op (1 byte), map (4 bytes), then arg (8 bytes) unless the op
+// is detach, clear or destroy, then value (8 bytes) for insertions. Little
+// endian.
+struct trace_record {
+  op type;
+  uint32_t map = 0;
+  uint64_t arg = 0;
+  uint64_t value = 0;
+};
+
+inline bool has_arg(op o) {
+  return o != op::detach and o != op::clear and o != op::destroy;
+}
+
+inline bool has_value(op o) {
+  return o == op::insert_or_assign or o == op::insert;
+}
+
+template<typename T>
+uint64_t trace_value(const T& v) {
+  if constexpr (std::is_integral<T>::value or std::is_enum<T>::value) {
+    return static_cast<uint64_t>(v);
+  } else {
+    return std::hash<T>()(v);
+  }
+}
+
+// Values without std::hash are recorded as 0.
+template<typename T, typename = void>
+struct is_hashable : std::false_type { };
+
+template<typename T>
+struct is_hashable<T, std::void_t<decltype(std::hash<T>()(
+    std::declval<const T&>()))>> : std::true_type { };
+
+template<typename T>
+uint64_t trace_mapped_value(const T& v) {
+  if constexpr (std::is_integral<T>::value or std::is_enum<T>::value
+                  or is_hashable<T>::value) {
+    return trace_value(v);
+  } else {
+    return 0;
+  }
+}
+
+// Process wide sink of the trace records. Thread safe.
+class recorder {
+ public:
+  static recorder& global() {
+    static recorder* r = new recorder();
+    return *r;
+  }
+
+  // Starts writing to the file @path, truncating it. Returns false if it
+  // can't be opened.
+  bool start(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ != nullptr) return false;
+    file_ = std::fopen(path.c_str(), "wb");
+    if (file_ == nullptr) return false;
+    active_.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Flushes and closes the trace.
+  void stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ == nullptr) return;
+    active_.store(false, std::memory_order_relaxed);
+    flush();
+    std::fclose(file_);
+    file_ = nullptr;
+    ids_.clear();
+  }
+
+  bool active() const { return active_.load(std::memory_order_relaxed); }
+
+  void record(op o, const void* map, uint64_t arg = 0, uint64_t value = 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ == nullptr) return;
+    if (o == op::destroy) {
+      // Maps never used while recording are left out.
+      auto it = ids_.find(map);
+      if (it == ids_.end()) return;
+      append(o, it->second, 0, 0);
+      ids_.erase(it);
+      return;
+    }
+    append(o, id_of(map), arg, value);
+  }
+
+  void record_map(op o, const void* map, const void* other) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ == nullptr) return;
+    uint32_t other_id = id_of(other);
+    append(o, id_of(map), other_id, 0);
+  }
+
+  void record_maps(op o, const void* map, const void* first,
+                   const void* second) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ == nullptr) return;
+    uint64_t first_id = id_of(first);
+    uint64_t second_id = id_of(second);
+    append(o, id_of(map), first_id | (second_id << 32), 0);
+  }
+
+ private:
+  static constexpr size_t kBufferSize = 1 << 16;
+
+  recorder() = default;
+
+  uint32_t id_of(const void* map) {
+    auto r = ids_.try_emplace(map, next_id_);
+    if (r.second) next_id_++;
+    return r.first->second;
+  }
+
+  void append(op o, uint32_t map, uint64_t arg, uint64_t value) {
+    put(static_cast<uint8_t>(o));
+    put(map);
+    if (has_arg(o)) put(arg);
+    if (has_value(o)) put(value);
+    if (buffer_.size() >= kBufferSize) flush();
+  }
+
+  template<typename T>
+  void put(T x) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+      buffer_.push_back(static_cast<char>((x >> (8 * i)) & 0xff));
+    }
+  }
+
+  void flush() {
+    std::fwrite(buffer_.data(), 1, buffer_.size(), file_);
+    buffer_.clear();
+  }
+
+  std::mutex mutex_;
+  std::atomic<bool> active_{false};
+  std::FILE* file_ = nullptr;
+  std::vector<char> buffer_;
+  std::unordered_map<const void*, uint32_t> ids_;  // Of the live maps.
+  uint32_t next_id_ = 0;
+};
+
+// Reads the little endian integer @x from @in. Returns false at the end.
+template<typename T>
+bool read_le(std::FILE* in, T* x) {
+  unsigned char bytes[sizeof(T)];
+  if (std::fread(bytes, 1, sizeof(T), in) != sizeof(T)) return false;
+  *x = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    *x |= static_cast<T>(bytes[i]) << (8 * i);
+  }
+  return true;
+}
+
+// Next record of the trace @in, or nullopt at its end.
+inline std::optional<trace_record> read_record(std::FILE* in) {
+  uint8_t type;
+  trace_record r;
+  if (not read_le(in, &type) or not read_le(in, &r.map)) return std::nullopt;
+  r.type = static_cast<op>(type);
+  if (has_arg(r.type) and not read_le(in, &r.arg)) return std::nullopt;
+  if (has_value(r.type) and not read_le(in, &r.value)) return std::nullopt;
+  return r;
+}
+
+// Hooks called by lazy_map, see QUICK_LAZY_MAP_TRACE_HOOK.
+inline void on_copy(const void* map, const void* from) {
+  auto& r = recorder::global();
+  if (r.active()) r.record_map(op::copy, map, from);
+}
+
+inline void on_move(const void* map, const void* from) {
+  auto& r = recorder::global();
+  if (r.active()) r.record_map(op::move, map, from);
+}
+
+inline void on_destroy(const void* map) {
+  auto& r = recorder::global();
+  if (r.active()) r.record(op::destroy, map);
+}
+
+inline void on_detach(const void* map) {
+  auto& r = recorder::global();
+  if (r.active()) r.record(op::detach, map);
+}
+
+inline void on_clear(const void* map) {
+  auto& r = recorder::global();
+  if (r.active()) r.record(op::clear, map);
+}
+
+inline void on_rebase(const void* map, const void* old_base,
+                      const void* new_base) {
+  auto& r = recorder::global();
+  if (r.active()) r.record_maps(op::rebase, map, old_base, new_base);
+}
+
+inline void on_compact(const void* map, size_t ratio) {
+  auto& r = recorder::global();
+  if (r.active()) r.record(op::compact, map, ratio);
+}
+
+inline void on_flatten_top(const void* map, size_t k) {
+  auto& r = recorder::global();
+  if (r.active()) r.record(op::flatten_top, map, k);
+}
+
+inline void on_flatten_until(const void* map, size_t size_threshold) {
+  auto& r = recorder::global();
+  if (r.active()) r.record(op::flatten_until, map, size_threshold);
+}
+
+template<typename K>
+void on_find(const void* map, const K& k) {
+  auto& r = recorder::global();
+  if (r.active()) r.record(op::find, map, trace_value(k));
+}
+
+template<typename K>
+void on_erase(const void* map, const K& k) {
+  auto& r = recorder::global();
+  if (r.active()) r.record(op::erase, map, trace_value(k));
+}
+
+template<typename K, typename... V>
+void on_insert(const void* map, const K& k, const V&... v) {
+  auto& r = recorder::global();
+  if (r.active()) r.record(op::insert, map, trace_value(k),
+                           (0 + ... + trace_mapped_value(v)));
+}
+
+template<typename K, typename V>
+void on_insert_or_assign(const void* map, const K& k, const V& v) {
+  auto& r = recorder::global();
+  if (r.active()) {
+    r.record(op::insert_or_assign, map, trace_value(k), trace_mapped_value(v));
+  }
+}
+
+// A map constructed with entries, recorded as their insertion.
+template<typename Map>
+void on_construct(const void* map, const Map& m) {
+  auto& r = recorder::global();
+  if (not r.active()) return;
+  for (const auto& kv : m) {
+    r.record(op::insert, map, trace_value(kv.first),
+             trace_mapped_value(kv.second));
+  }
+}
+
+}  // namespace lazy_map_trace
+}  // namespace quick
+
+#endif  // QUICK_LAZY_MAP_TRACE_HPP_
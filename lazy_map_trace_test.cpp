@@ -0,0 +1,167 @@
+// Author: Mohit Saini (mohitsaini1196@gmail.com)
+
+#define QUICK_LAZY_MAP_TRACE
+#include "lazy_map.hpp"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using std::vector;
+using quick::lazy_map;
+namespace trace = quick::lazy_map_trace;
+
+vector<trace::trace_record> ReadTrace(const std::string& path) {
+  vector<trace::trace_record> output;
+  std::FILE* in = std::fopen(path.c_str(), "rb");
+  while (auto r = trace::read_record(in)) {
+    output.push_back(*r);
+  }
+  std::fclose(in);
+  return output;
+}
+
+TEST(LazyMapTraceTest, RecordAndRead) {
+  std::string path = ::testing::TempDir() + "lazy_map_trace_test.bin";
+  lazy_map<int, int> unused;
+  unused.insert_or_assign(1, 1);  // Not recorded.
+  ASSERT_TRUE(trace::recorder::global().start(path));
+  EXPECT_FALSE(trace::recorder::global().start(path));
+  {
+    lazy_map<int, int> m;
+    m.insert_or_assign(5, 50);
+    EXPECT_TRUE(m.insert(6, 60));
+    auto m2 = m;
+    m2.erase(5);
+    EXPECT_FALSE(m2.contains(5));
+    m2.detach();
+    lazy_map<int, std::string> m3 = {{7, "x"}};
+    lazy_map<int, int> m4 = std::move(m);
+    m4.clear();
+  }
+  trace::recorder::global().stop();
+  unused.erase(1);  // Not recorded.
+
+  using trace::op;
+  struct expected { op type; uint32_t map; uint64_t arg; uint64_t value; };
+  vector<expected> expected_records = {
+    {op::insert_or_assign, 0, 5, 50},
+    {op::insert, 0, 6, 60},
+    {op::copy, 1, 0, 0},
+    {op::erase, 1, 5, 0},
+    {op::find, 1, 5, 0},
+    {op::detach, 1, 0, 0},
+    {op::insert, 2, 7, std::hash<std::string>()("x")},
+    {op::move, 3, 0, 0},
+    {op::clear, 3, 0, 0},
+    // Destroyed in reverse order of construction.
+    {op::destroy, 3, 0, 0},
+    {op::destroy, 2, 0, 0},
+    {op::destroy, 1, 0, 0},
+    {op::destroy, 0, 0, 0},
+  };
+  auto records = ReadTrace(path);
+  ASSERT_EQ(expected_records.size(), records.size());
+  for (size_t i = 0; i < records.size(); i++) {
+    SCOPED_TRACE(i);
+    EXPECT_EQ(expected_records[i].type, records[i].type);
+    EXPECT_EQ(expected_records[i].map, records[i].map);
+    EXPECT_EQ(expected_records[i].arg, records[i].arg);
+    EXPECT_EQ(expected_records[i].value, records[i].value);
+  }
+  std::remove(path.c_str());
+}
+
+TEST(LazyMapTraceTest, EditsWithoutOpsOfTheirOwn) {
+  std::string path = ::testing::TempDir() + "lazy_map_trace_edits.bin";
+  ASSERT_TRUE(trace::recorder::global().start(path));
+  {
+    lazy_map<int, int> m;
+    m.insert_or_assign(1, 10);
+    m.insert_or_assign(2, 20);
+    auto nh = m.extract(1);
+    lazy_map<int, int> m2;
+    EXPECT_TRUE(m2.insert(std::move(nh)));
+    m2.update(1, [](int& v) { v++; });
+    auto m3 = m2;
+    m3.update(1, [](int& v) { v++; });
+    m3.compact();
+    m3.flatten_top(1);
+    m3.flatten_until(0);
+    EXPECT_TRUE(m3.rebase(m2, m));
+    auto detached = m3.detach_async([](auto&& task) { task(); });
+    EXPECT_TRUE(m3.complete_detach(detached.get()));
+    std::move(m3).drain([](const int&, int&&) { });
+  }
+  trace::recorder::global().stop();
+
+  using trace::op;
+  struct expected { op type; uint32_t map; uint64_t arg; uint64_t value; };
+  // The map numbers in the arg of copy and rebase are checked below.
+  vector<expected> expected_records = {
+    {op::insert_or_assign, 0, 1, 10},
+    {op::insert_or_assign, 0, 2, 20},
+    {op::erase, 0, 1, 0},  // extract
+    {op::insert, 1, 1, 10},  // insert(node_type&&)
+    {op::insert_or_assign, 1, 1, 11},  // update
+    {op::copy, 2, 0, 0},
+    {op::insert_or_assign, 2, 1, 12},
+    {op::compact, 2, 2, 0},
+    {op::flatten_top, 2, 1, 0},
+    {op::flatten_until, 2, 0, 0},
+    // The new base is passed by value.
+    {op::copy, 3, 0, 0},
+    {op::rebase, 2, 0, 0},
+    {op::destroy, 3, 0, 0},
+    {op::detach, 2, 0, 0},  // complete_detach
+    {op::clear, 2, 0, 0},  // drain
+    {op::destroy, 2, 0, 0},
+    {op::destroy, 1, 0, 0},
+    {op::destroy, 0, 0, 0},
+  };
+  auto records = ReadTrace(path);
+  ASSERT_EQ(expected_records.size(), records.size());
+  // Map numbers carry on from the previous traces of the process.
+  uint32_t first = records[0].map;
+  for (size_t i = 0; i < records.size(); i++) {
+    SCOPED_TRACE(i);
+    EXPECT_EQ(expected_records[i].type, records[i].type);
+    EXPECT_EQ(expected_records[i].map + first, records[i].map);
+    if (records[i].type != op::copy and records[i].type != op::rebase) {
+      EXPECT_EQ(expected_records[i].arg, records[i].arg);
+    }
+    EXPECT_EQ(expected_records[i].value, records[i].value);
+  }
+  EXPECT_EQ(first + 1, records[5].arg);
+  EXPECT_EQ(first, records[10].arg);
+  EXPECT_EQ((first + 1) | (uint64_t(first + 3) << 32), records[11].arg);
+  std::remove(path.c_str());
+}
+
+TEST(LazyMapTraceTest, Encoding) {
+  std::string path = ::testing::TempDir() + "lazy_map_trace_encoding.bin";
+  ASSERT_TRUE(trace::recorder::global().start(path));
+  {
+    lazy_map<uint64_t, int> m;
+    m.insert_or_assign(uint64_t(1) << 40, -1);
+    m.detach();
+  }
+  trace::recorder::global().stop();
+  std::FILE* in = std::fopen(path.c_str(), "rb");
+  std::fseek(in, 0, SEEK_END);
+  // insert_or_assign: 1 + 4 + 8 + 8, detach and destroy: 1 + 4 each.
+  EXPECT_EQ(31, std::ftell(in));
+  std::fclose(in);
+  auto records = ReadTrace(path);
+  ASSERT_EQ(3, records.size());
+  EXPECT_EQ(uint64_t(1) << 40, records[0].arg);
+  EXPECT_EQ(~uint64_t(0), records[0].value);
+  std::remove(path.c_str());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
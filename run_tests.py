@@ -1,20 +1,29 @@
 #! /usr/bin/env python3
 
+import glob
 import os
+import sys
 
 CC = 'clang++ -std=c++17 -O3'
 
+# `run_tests.py --tsan` runs the concurrent tests under ThreadSanitizer.
+TSAN = '--tsan' in sys.argv[1:]
+
+if TSAN:
+  CC = 'clang++ -std=c++17 -O1 -g -fsanitize=thread'
+
 GTEST = "/usr/local/scaligent/toolchain/local"
 
 INCLUDES = f"-I{GTEST}/include"
 
 GTEST_LIB = f"{GTEST}/lib/libgtest.a"
 
-OUTPUT_BIN = "/tmp/lazy_map_test"
-
 run_command = lambda c : (print(c), os.system(c))
 
-COMPILE = f"{CC} lazy_map_test.cpp {INCLUDES} {GTEST_LIB} -o {OUTPUT_BIN}"
+TESTS = "concurrent_*_test.cpp" if TSAN else "*_test.cpp"
 
-run_command(f"{COMPILE} && time {OUTPUT_BIN}")
+for test in sorted(glob.glob(TESTS)):
+  output_bin = f"/tmp/{test[:-len('.cpp')]}"
+  compile = f"{CC} {test} {INCLUDES} {GTEST_LIB} -lpthread -o {output_bin}"
+  run_command(f"{compile} && time {output_bin}")
 